@@ -1,9 +1,34 @@
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
 #include <strsafe.h>
+// Lean and mean leaves timeBeginPeriod out
+#include <mmsystem.h>
 #pragma comment(lib, "User32")
+#pragma comment(lib, "Winmm")
 #include <cassert>
 #include <cstdlib>
+#include <emmintrin.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+// __rdtsc
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+
+// Set to 0 to compile the PROFILE_ZONEs out
+#ifndef PROFILER_ENABLED
+#define PROFILER_ENABLED 1
+#endif
+#define PROFILE_JOIN2(a, b) a##b
+#define PROFILE_JOIN(a, b) PROFILE_JOIN2(a, b)
+#if PROFILER_ENABLED
+#define PROFILE_ZONE(name) Win32::Profiler::Zone PROFILE_JOIN(profileZone, __LINE__)(name)
+#else
+#define PROFILE_ZONE(name)
+#endif
 namespace Win32 {
     // Clears the console associated with the stdout
     void ClearConsole() {
@@ -50,6 +75,23 @@ namespace Win32 {
         va_end(args);
     }
 
+    // Looks for name in the command line and returns what follows it (skipping spaces), or NULL if it isn't there
+    const char* FindArgument(const char* cmdline, const char* name) {
+        if (!cmdline) return NULL;
+        int nameLength = lstrlenA(name);
+        for (const char* c = cmdline; *c; c++) {
+            if (c != cmdline && c[-1] != ' ') continue;
+            int i = 0;
+            while (i < nameLength && c[i] == name[i]) i++;
+            if (i == nameLength && (c[nameLength] == ' ' || c[nameLength] == 0)) {
+                c += nameLength;
+                while (*c == ' ') c++;
+                return c;
+            }
+        }
+        return NULL;
+    }
+
     // Given a windowHandle, queries the width, height and position (x, y) of the window
     void GetWindowSizeAndPosition(HWND windowHandle, int* width, int* height, int* x, int* y, bool printDebug) {
         RECT rect;
@@ -244,9 +286,7 @@ namespace Win32 {
         // Cycles per second
         *cpuFrequencySeconds = performanceFrequency.QuadPart;
 
-        // TODO: There is some other ways of getting performance information such as __rdtsc()...
-        // I should try it since (I think) might be more precise, since it is an intrinsic function from the compiler?
-        // uint64 cyclecount = __rdtsc();
+        // For finer grained timing there is __rdtsc(), see Profiler
     }
     
     // Given the previous cpu counter to compare with, and the cpu frequency (Use GetCpuCounterAndFrequencySeconds)
@@ -263,6 +303,421 @@ namespace Win32 {
         return cpuCounter.QuadPart;
     }
 
+    // Keeps frames at a target length. Call EndFrame once per frame, after presenting.
+    //   Uncapped: doesn't wait, only measures.
+    //   Capped: waits until targetMs since the previous frame began, sleeping while there is time and spinning the last bit, since
+    //   Sleep can overshoot by a scheduler tick. spinMs adapts to how much Sleep actually overshoots.
+    //   Vsync: SwapBuffers already blocks (wglSwapIntervalEXT(1)), so it only measures, targetMs being the refresh period.
+    // A frame that takes longer than targetMs (plus a bit of slack in Vsync, where the measure jitters) is a missed deadline.
+    struct FramePacer {
+        enum paceMode {
+            Uncapped,
+            Capped,
+            Vsync
+        };
+        paceMode mode = Vsync;
+        double targetMs = 1000.0 / 60.0;
+        double spinMs = 2.0;
+        unsigned long long frequency = 0;
+        unsigned long long frameStart = 0;
+        // The whole last frame, waiting included, and the part of it before waiting
+        double frameMs = 0.0;
+        double workMs = 0.0;
+        unsigned long long fps = 0;
+        unsigned long frames = 0;
+        unsigned long missedDeadlines = 0;
+        bool periodRaised = false;
+
+        void Initialize(paceMode newMode, double newTargetMs) {
+            mode = newMode;
+            targetMs = newTargetMs;
+            // So that Sleep(1) is about 1 ms and not 15.6
+            if (mode == Capped && !periodRaised) {
+                periodRaised = timeBeginPeriod(1) == TIMERR_NOERROR;
+            }
+            GetCpuCounterAndFrequencySeconds(&frameStart, &frequency);
+        }
+
+        void Release() {
+            if (periodRaised) {
+                timeEndPeriod(1);
+                periodRaised = false;
+            }
+        }
+
+        double ElapsedMs() {
+            double ms;
+            unsigned long long ignored;
+            GetTimeDifferenceMsAndFPS(frameStart, frequency, &ms, &ignored);
+            return ms;
+        }
+
+        void EndFrame() {
+            workMs = ElapsedMs();
+            bool missed = mode == Vsync ? workMs > targetMs * 1.5 : (mode == Capped && workMs > targetMs);
+            if (missed) {
+                missedDeadlines++;
+            }
+            if (mode == Capped && !missed) {
+                double remainingMs = targetMs - workMs;
+                if (remainingMs > spinMs) {
+                    double beforeSleepMs = ElapsedMs();
+                    DWORD sleepMs = (DWORD) (remainingMs - spinMs);
+                    Sleep(sleepMs);
+                    double overshootMs = ElapsedMs() - beforeSleepMs - (double) sleepMs;
+                    // Keep a margin of the overshoot seen lately plus half a ms
+                    spinMs = spinMs * 0.9 + (overshootMs + 0.5) * 0.1;
+                    if (spinMs < 0.5) spinMs = 0.5;
+                    if (spinMs > 4.0) spinMs = 4.0;
+                }
+                while (ElapsedMs() < targetMs) {
+                    YieldProcessor();
+                }
+            }
+            frameStart = GetTimeDifferenceMsAndFPS(frameStart, frequency, &frameMs, &fps);
+            frames++;
+        }
+    };
+
+    // Turns frame times into a whole number of fixed length simulation ticks, so the simulation runs at the same speed whatever
+    // the frame rate. What is left over (less than a tick) is carried to the next frame, and Alpha() says how far into the next
+    // tick the frame is, to interpolate between the last two simulated states when drawing.
+    // If a frame asks for more than maxTicksPerFrame ticks the rest is dropped (the game slows down instead of falling further
+    // behind trying to catch up) and it counts as a stall.
+    struct FixedTimestep {
+        double tickMs = 1000.0 / 60.0;
+        int maxTicksPerFrame = 5;
+        double accumulatorMs = 0.0;
+        unsigned long ticks = 0;
+        unsigned long stalls = 0;
+
+        void Initialize(double ticksPerSecond, int newMaxTicksPerFrame) {
+            tickMs = 1000.0 / ticksPerSecond;
+            maxTicksPerFrame = newMaxTicksPerFrame;
+            accumulatorMs = 0.0;
+        }
+
+        // Adds the length of the last frame and returns how many ticks to simulate this frame
+        int Advance(double frameMs) {
+            accumulatorMs += frameMs;
+            int due = (int) (accumulatorMs / tickMs);
+            accumulatorMs -= due * tickMs;
+            if (due > maxTicksPerFrame) {
+                due = maxTicksPerFrame;
+                stalls++;
+            }
+            ticks += due;
+            return due;
+        }
+
+        // 0 right at the last tick, close to 1 right before the next one
+        float Alpha() {
+            return (float) (accumulatorMs / tickMs);
+        }
+    };
+
+    // Hierarchical cpu profiler. PROFILE_ZONE("name") times the rest of the scope it's in by writing a begin and an end event
+    // (__rdtsc and the name) to a ring buffer of the calling thread, which is all it costs where it's used. Once per frame
+    // Profiler::EndFrame, from one thread, reads every ring and aggregates the zones into a tree per thread (calls and total
+    // ticks by name under each parent), kept in LastFrame(). While capturing the zones are also kept as they are, to be written
+    // as a Chrome trace (chrome://tracing or Perfetto). With PROFILER_ENABLED 0 the zones compile to nothing.
+    // A thread that writes more than ringSize events between two EndFrame loses the oldest ones (counted in lostEvents).
+    namespace Profiler {
+        struct Event {
+            unsigned long long tsc;
+            const char* name;
+            unsigned long long isEnd;
+        };
+        static constexpr unsigned long long ringSize = 1 << 16;
+        static constexpr int maxThreads = 32;
+        static constexpr int maxDepth = 64;
+        struct Ring {
+            Event events[ringSize];
+            // Only the owner thread writes it, after the event
+            volatile unsigned long long write;
+            // Only EndFrame touches the rest
+            unsigned long long read;
+            struct OpenZone {
+                const char* name;
+                unsigned long long begin;
+                int node;
+            };
+            OpenZone open[maxDepth];
+            int openCount;
+        };
+
+        static constexpr int maxNodes = 1024;
+        struct Node {
+            const char* name;
+            int thread;
+            int parent;
+            int firstChild;
+            int nextSibling;
+            unsigned long calls;
+            unsigned long long ticks;
+        };
+        struct Frame {
+            Node nodes[maxNodes];
+            int nodeCount;
+            // Top level zones of every thread, linked through nextSibling
+            int firstRoot;
+            unsigned long long beginTsc;
+            unsigned long long endTsc;
+        };
+
+        struct CapturedZone {
+            const char* name;
+            int thread;
+            unsigned long long begin;
+            unsigned long long end;
+        };
+
+        static Ring* rings[maxThreads];
+        static volatile LONG ringCount = 0;
+        static thread_local Ring* threadRing = 0;
+        // Set on the threads that came after the first maxThreads, their zones aren't recorded
+        static thread_local bool threadDropped = false;
+        static Frame frames[2];
+        static int currentFrame = 0;
+        static double ticksPerMicrosecond = 1.0;
+        static unsigned long long startTsc = 0;
+        static unsigned long long lostEvents = 0;
+        static CapturedZone* capture = 0;
+        static unsigned long captureCount = 0;
+        static unsigned long captureCapacity = 0;
+
+        // Measures the rdtsc frequency against QueryPerformanceCounter, it takes about 20 ms
+        void Initialize() {
+            unsigned long long counter, frequency;
+            GetCpuCounterAndFrequencySeconds(&counter, &frequency);
+            unsigned long long tsc = __rdtsc();
+            Sleep(20);
+            double ms;
+            unsigned long long fps;
+            GetTimeDifferenceMsAndFPS(counter, frequency, &ms, &fps);
+            ticksPerMicrosecond = (double) (__rdtsc() - tsc) / (ms * 1000.0);
+            startTsc = __rdtsc();
+            frames[0].firstRoot = frames[1].firstRoot = -1;
+            frames[currentFrame].beginTsc = startTsc;
+        }
+
+        // Returns the ring of the calling thread, or 0 if there are already maxThreads of them
+        Ring* RegisterThread() {
+            LONG index = InterlockedIncrement(&ringCount) - 1;
+            if (index >= maxThreads) {
+                threadDropped = true;
+                return 0;
+            }
+            Ring* ring = (Ring*) HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(Ring));
+            assert(ring && "Couldn't allocate a profiler ring");
+            rings[index] = ring;
+            threadRing = ring;
+            return ring;
+        }
+
+        // Threads registered so far, ringCount keeps counting the ones that didn't fit
+        int RingCount() {
+            return ringCount < maxThreads ? (int) ringCount : maxThreads;
+        }
+
+        inline void Push(const char* name, unsigned long long isEnd) {
+            Ring* ring = threadRing;
+            if (!ring) {
+                if (threadDropped || !(ring = RegisterThread())) return;
+            }
+            unsigned long long index = ring->write;
+            Event& event = ring->events[index & (ringSize - 1)];
+            event.tsc = __rdtsc();
+            event.name = name;
+            event.isEnd = isEnd;
+            _ReadWriteBarrier();
+            ring->write = index + 1;
+        }
+
+        struct Zone {
+            const char* name;
+            Zone(const char* name) : name(name) { Push(name, 0); }
+            ~Zone() { Push(name, 1); }
+        };
+
+        // Returns the node of name under parent (-1 for the top level of thread), adding it if it isn't there. -1 if it's full
+        int FindOrAddNode(Frame& frame, int thread, int parent, const char* name) {
+            int* link = parent >= 0 ? &frame.nodes[parent].firstChild : &frame.firstRoot;
+            while (*link >= 0) {
+                Node& node = frame.nodes[*link];
+                if (node.thread == thread && (node.name == name || lstrcmpA(node.name, name) == 0)) {
+                    return *link;
+                }
+                link = &node.nextSibling;
+            }
+            if (frame.nodeCount == maxNodes) {
+                return -1;
+            }
+            int index = frame.nodeCount++;
+            Node& node = frame.nodes[index];
+            node.name = name;
+            node.thread = thread;
+            node.parent = parent;
+            node.firstChild = -1;
+            node.nextSibling = -1;
+            node.calls = 0;
+            node.ticks = 0;
+            *link = index;
+            return index;
+        }
+
+        // Keeps every zone that ends from now on (up to maxZones) for WriteChromeTrace
+        void BeginCapture(unsigned long maxZones) {
+            if (capture) {
+                HeapFree(GetProcessHeap(), 0, capture);
+            }
+            capture = (CapturedZone*) HeapAlloc(GetProcessHeap(), 0, sizeof(CapturedZone) * maxZones);
+            captureCapacity = capture ? maxZones : 0;
+            captureCount = 0;
+        }
+
+        // Aggregates what the threads recorded since the last call into the current frame, which becomes LastFrame()
+        void EndFrame() {
+            Frame& frame = frames[currentFrame];
+            frame.endTsc = __rdtsc();
+            for (int thread = 0; thread < RingCount(); thread++) {
+                Ring* ring = rings[thread];
+                if (!ring) continue;
+                unsigned long long write = ring->write;
+                _ReadWriteBarrier();
+                if (write - ring->read > ringSize) {
+                    // Overwritten before we got to them, and whatever was open can't be matched anymore
+                    lostEvents += write - ring->read - ringSize;
+                    ring->read = write - ringSize;
+                    ring->openCount = 0;
+                }
+                for (; ring->read < write; ring->read++) {
+                    const Event& event = ring->events[ring->read & (ringSize - 1)];
+                    if (!event.isEnd) {
+                        int parent = ring->openCount ? ring->open[ring->openCount - 1].node : -1;
+                        int node = (ring->openCount && parent < 0) ? -1 : FindOrAddNode(frame, thread, parent, event.name);
+                        if (ring->openCount < maxDepth) {
+                            Ring::OpenZone& open = ring->open[ring->openCount];
+                            open.name = event.name;
+                            open.begin = event.tsc;
+                            open.node = node;
+                        }
+                        ring->openCount++;
+                    }
+                    else if (ring->openCount) {
+                        ring->openCount--;
+                        if (ring->openCount >= maxDepth) continue;
+                        Ring::OpenZone& open = ring->open[ring->openCount];
+                        if (open.node >= 0) {
+                            frame.nodes[open.node].calls++;
+                            frame.nodes[open.node].ticks += event.tsc - open.begin;
+                        }
+                        if (captureCount < captureCapacity) {
+                            CapturedZone& zone = capture[captureCount++];
+                            zone.name = open.name;
+                            zone.thread = thread;
+                            zone.begin = open.begin;
+                            zone.end = event.tsc;
+                        }
+                    }
+                }
+            }
+            // Zones still open carry on into the next frame, so they need nodes there
+            currentFrame ^= 1;
+            Frame& next = frames[currentFrame];
+            next.nodeCount = 0;
+            next.firstRoot = -1;
+            next.beginTsc = frame.endTsc;
+            for (int thread = 0; thread < RingCount(); thread++) {
+                Ring* ring = rings[thread];
+                if (!ring) continue;
+                int depth = ring->openCount < maxDepth ? ring->openCount : maxDepth;
+                for (int i = 0; i < depth; i++) {
+                    int parent = i ? ring->open[i - 1].node : -1;
+                    ring->open[i].node = (i && parent < 0) ? -1 : FindOrAddNode(next, thread, parent, ring->open[i].name);
+                }
+            }
+        }
+
+        const Frame& LastFrame() {
+            return frames[currentFrame ^ 1];
+        }
+
+        double TicksToMs(unsigned long long ticks) {
+            return (double) ticks / (ticksPerMicrosecond * 1000.0);
+        }
+
+        void PrintNode(const Frame& frame, int index, int depth) {
+            for (; index >= 0; index = frame.nodes[index].nextSibling) {
+                const Node& node = frame.nodes[index];
+                char indentation[2 * maxDepth + 1];
+                int i = 0;
+                for (; i < depth * 2 && i < 2 * maxDepth; i++) indentation[i] = ' ';
+                indentation[i] = 0;
+                FormattedPrint("%s%s [thread %d]: %f ms, %d calls\n", indentation, node.name, node.thread, TicksToMs(node.ticks), (int) node.calls);
+                PrintNode(frame, node.firstChild, depth + 1);
+            }
+        }
+
+        // Prints the zone tree of the last frame
+        void PrintLastFrame() {
+            const Frame& frame = LastFrame();
+            FormattedPrint("Frame: %f ms\n", TicksToMs(frame.endTsc - frame.beginTsc));
+            PrintNode(frame, frame.firstRoot, 1);
+        }
+
+        // Writes the captured zones as complete ("X") events of the Chrome trace event format, in microseconds since Initialize
+        bool WriteChromeTrace(const char* path) {
+            HANDLE file = CreateFileA(path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+            if (file == INVALID_HANDLE_VALUE) {
+                return false;
+            }
+            static char buffer[1 << 16];
+            size_t used = 0;
+            DWORD written;
+            bool ok = true;
+            StringCbPrintfA(buffer, sizeof(buffer), "{\"traceEvents\":[\n");
+            used = lstrlenA(buffer);
+            for (unsigned long i = 0; i < captureCount && ok; i++) {
+                const CapturedZone& zone = capture[i];
+                char line[256];
+                StringCbPrintfA(line, sizeof(line), "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}%s\n",
+                    zone.name, zone.thread, (double) (zone.begin - startTsc) / ticksPerMicrosecond,
+                    (double) (zone.end - zone.begin) / ticksPerMicrosecond, i + 1 < captureCount ? "," : "");
+                size_t length = lstrlenA(line);
+                if (used + length > sizeof(buffer)) {
+                    ok = WriteFile(file, buffer, (DWORD) used, &written, NULL) != 0;
+                    used = 0;
+                }
+                CopyMemory(buffer + used, line, length);
+                used += length;
+            }
+            const char end[] = "]}\n";
+            if (used + sizeof(end) > sizeof(buffer)) {
+                ok = ok && WriteFile(file, buffer, (DWORD) used, &written, NULL) != 0;
+                used = 0;
+            }
+            CopyMemory(buffer + used, end, sizeof(end) - 1);
+            used += sizeof(end) - 1;
+            ok = ok && WriteFile(file, buffer, (DWORD) used, &written, NULL) != 0;
+            CloseHandle(file);
+            return ok;
+        }
+
+        // Times zoneCount empty zones, as the whole cost of a zone on the thread that records it (--bench profiler)
+        void Benchmark(unsigned long zoneCount) {
+            unsigned long long counter, frequency;
+            GetCpuCounterAndFrequencySeconds(&counter, &frequency);
+            for (unsigned long i = 0; i < zoneCount; i++) {
+                PROFILE_ZONE("Profiler benchmark");
+            }
+            double ms;
+            unsigned long long fps;
+            GetTimeDifferenceMsAndFPS(counter, frequency, &ms, &fps);
+            FormattedPrint("Profiler: %d zones in %d us, %f ns per zone\n", (int) zoneCount, (int) (ms * 1000.0), ms * 1000000.0 / zoneCount);
+        }
+    }
+
     bool GetConsoleCursorPosition(short *cursorX, short *cursorY) {
         CONSOLE_SCREEN_BUFFER_INFO cbsi;
         if (GetConsoleScreenBufferInfo(GetStdHandle(STD_OUTPUT_HANDLE), &cbsi)) {
@@ -309,9 +764,96 @@ namespace Win32 {
     void SwapPixelBuffers(HDC deviceContextHandle) {
         // The SwapBuffers function exchanges the front and back buffers if the
         // current pixel format for the window referenced by the specified device context includes a back buffer.
+        PROFILE_ZONE("Swap buffers");
         SwapBuffers(deviceContextHandle);
     }
 
+    // A few worker threads that run the tasks of one job at a time, together with the thread that calls Run.
+    // Tasks are claimed with a compare exchange on nextTask so a worker waking up late from a previous job can't run a task twice.
+    struct ThreadPool {
+        typedef void Task(void* data, int task);
+        static constexpr int maxThreads = 32;
+        HANDLE threads[maxThreads];
+        int threadCount = 0;
+        HANDLE workAvailable = 0;
+        HANDLE workDone = 0;
+        Task* task = 0;
+        void* taskData = 0;
+        volatile LONG taskCount = 0;
+        volatile LONG nextTask = 0;
+        volatile LONG tasksRemaining = 0;
+        volatile LONG quit = 0;
+
+        static DWORD WINAPI Worker(LPVOID parameter) {
+            ThreadPool* pool = (ThreadPool*) parameter;
+            for (;;) {
+                WaitForSingleObject(pool->workAvailable, INFINITE);
+                if (pool->quit) {
+                    return 0;
+                }
+                pool->RunTasks();
+            }
+        }
+
+        void RunTasks() {
+            for (;;) {
+                LONG claimed = nextTask;
+                if (claimed >= taskCount) {
+                    return;
+                }
+                if (InterlockedCompareExchange(&nextTask, claimed + 1, claimed) != claimed) {
+                    continue;
+                }
+                task(taskData, claimed);
+                if (InterlockedDecrement(&tasksRemaining) == 0) {
+                    SetEvent(workDone);
+                }
+            }
+        }
+
+        // workerCount threads besides the one calling Run. 0 is fine, then Run just runs everything in place
+        void Initialize(int workerCount) {
+            assert(workerCount <= maxThreads && "Too many threads for the pool");
+            workAvailable = CreateSemaphore(NULL, 0, maxThreads, NULL);
+            workDone = CreateEvent(NULL, FALSE, FALSE, NULL);
+            for (threadCount = 0; threadCount < workerCount; threadCount++) {
+                threads[threadCount] = CreateThread(NULL, 0, Worker, this, 0, NULL);
+                assert(threads[threadCount] && "CreateThread failed");
+            }
+        }
+
+        void Release() {
+            InterlockedExchange(&quit, 1);
+            ReleaseSemaphore(workAvailable, threadCount, NULL);
+            WaitForMultipleObjects(threadCount, threads, TRUE, INFINITE);
+            for (int i = 0; i < threadCount; i++) {
+                CloseHandle(threads[i]);
+            }
+            CloseHandle(workAvailable);
+            CloseHandle(workDone);
+            threadCount = 0;
+        }
+
+        // Runs newTask(data, i) for i in [0, count) across the pool and returns when all of them are done
+        void Run(Task* newTask, void* data, int count) {
+            if (count == 0) {
+                return;
+            }
+            // Nobody can claim anything while the job is being swapped
+            InterlockedExchange(&taskCount, 0);
+            InterlockedExchange(&nextTask, 0);
+            task = newTask;
+            taskData = data;
+            InterlockedExchange(&tasksRemaining, count);
+            InterlockedExchange(&taskCount, count);
+            if (threadCount && count > 1) {
+                ReleaseSemaphore(workAvailable, count - 1 < threadCount ? count - 1 : threadCount, NULL);
+            }
+            RunTasks();
+            WaitForSingleObject(workDone, INFINITE);
+        }
+    };
+
     void Test1() {
         GetConsole();
         // ClearConsole();
@@ -365,6 +907,24 @@ namespace Win32 {
         DeclareExtension(PFNGLUNIFORMMATRIX4FVPROC, glUniformMatrix4fv);
         DeclareExtension(PFNGLUNIFORM2FVPROC, glUniform2fv);
         DeclareExtension(PFNGLGETUNIFORMLOCATIONPROC, glGetUniformLocation);
+        DeclareExtension(PFNGLBUFFERSUBDATAPROC, glBufferSubData);
+        DeclareExtension(PFNGLDELETEBUFFERSPROC, glDeleteBuffers);
+        DeclareExtension(PFNGLGETSTRINGIPROC, glGetStringi);
+        DeclareExtension(PFNGLMAPBUFFERRANGEPROC, glMapBufferRange);
+        DeclareExtension(PFNGLUNMAPBUFFERPROC, glUnmapBuffer);
+        DeclareExtension(PFNGLFENCESYNCPROC, glFenceSync);
+        DeclareExtension(PFNGLCLIENTWAITSYNCPROC, glClientWaitSync);
+        DeclareExtension(PFNGLDELETESYNCPROC, glDeleteSync);
+        DeclareExtension(PFNGLDRAWARRAYSINSTANCEDPROC, glDrawArraysInstanced);
+        DeclareExtension(PFNGLVERTEXATTRIBDIVISORPROC, glVertexAttribDivisor);
+        DeclareExtension(PFNGLDISABLEVERTEXATTRIBARRAYPROC, glDisableVertexAttribArray);
+        DeclareExtension(PFNGLVERTEXATTRIB1FPROC, glVertexAttrib1f);
+        DeclareExtension(PFNGLTEXIMAGE3DPROC, glTexImage3D);
+        DeclareExtension(PFNGLTEXSUBIMAGE3DPROC, glTexSubImage3D);
+        DeclareExtension(PFNGLUNIFORM1IPROC, glUniform1i);
+        DeclareExtension(PFNGLUNIFORM1FPROC, glUniform1f);
+        // Optional, might be NULL (OpenGL 4.4 or ARB_buffer_storage)
+        DeclareExtension(PFNGLBUFFERSTORAGEPROC, glBufferStorage);
         #undef DeclareExtension
 
         // Loops through and print all the errors related to OpenGL
@@ -473,9 +1033,206 @@ namespace Win32 {
             InitializeExtension(PFNGLUNIFORMMATRIX4FVPROC, glUniformMatrix4fv);
             InitializeExtension(PFNGLUNIFORM2FVPROC, glUniform2fv);
             InitializeExtension(PFNGLGETUNIFORMLOCATIONPROC, glGetUniformLocation);
+            InitializeExtension(PFNGLBUFFERSUBDATAPROC, glBufferSubData);
+            InitializeExtension(PFNGLDELETEBUFFERSPROC, glDeleteBuffers);
+            InitializeExtension(PFNGLGETSTRINGIPROC, glGetStringi);
+            InitializeExtension(PFNGLMAPBUFFERRANGEPROC, glMapBufferRange);
+            InitializeExtension(PFNGLUNMAPBUFFERPROC, glUnmapBuffer);
+            InitializeExtension(PFNGLFENCESYNCPROC, glFenceSync);
+            InitializeExtension(PFNGLCLIENTWAITSYNCPROC, glClientWaitSync);
+            InitializeExtension(PFNGLDELETESYNCPROC, glDeleteSync);
+            InitializeExtension(PFNGLDRAWARRAYSINSTANCEDPROC, glDrawArraysInstanced);
+            InitializeExtension(PFNGLVERTEXATTRIBDIVISORPROC, glVertexAttribDivisor);
+            InitializeExtension(PFNGLDISABLEVERTEXATTRIBARRAYPROC, glDisableVertexAttribArray);
+            InitializeExtension(PFNGLVERTEXATTRIB1FPROC, glVertexAttrib1f);
+            InitializeExtension(PFNGLTEXIMAGE3DPROC, glTexImage3D);
+            InitializeExtension(PFNGLTEXSUBIMAGE3DPROC, glTexSubImage3D);
+            InitializeExtension(PFNGLUNIFORM1IPROC, glUniform1i);
+            InitializeExtension(PFNGLUNIFORM1FPROC, glUniform1f);
             #undef InitializeExtension
+            // These ones are allowed to be missing, check them before using them
+            #define InitializeOptionalExtension(type, name) name = (type) GetFunctionAddress(#name);
+            InitializeOptionalExtension(PFNGLBUFFERSTORAGEPROC, glBufferStorage);
+            #undef InitializeOptionalExtension
+        }
+
+        // True if the current context lists the extension (for example "GL_ARB_buffer_storage")
+        bool HasExtension(const char* extensionName) {
+            GLint extensionCount = 0;
+            glGetIntegerv(GL_NUM_EXTENSIONS, &extensionCount);
+            for (GLint i = 0; i < extensionCount; i++) {
+                const char* name = (const char*) glGetStringi(GL_EXTENSIONS, i);
+                if (name && lstrcmpA(name, extensionName) == 0) {
+                    return true;
+                }
+            }
+            return false;
         }
 
+        // Remembers what is bound and which uniform values were set, and skips the gl calls that wouldn't change anything.
+        // Only works if every bind it tracks goes through it, call Invalidate() after anything else touches that state.
+        // Element array buffers aren't tracked since they are part of the vertex array object.
+        struct StateCache {
+            static constexpr int maxUniforms = 64;
+            static constexpr int maxUniformFloats = 16;
+            static constexpr int maxTextureUnits = 4;
+            struct Uniform {
+                GLuint program;
+                const char* name;
+                GLint location;
+                // Last value set, valueCount == 0 if none yet
+                int valueCount;
+                GLfloat value[maxUniformFloats];
+            };
+            GLuint program = 0;
+            GLuint vertexArray = 0;
+            GLuint arrayBuffer = 0;
+            // One texture per unit, whatever its target
+            GLuint textures[maxTextureUnits] = {};
+            GLenum activeTextureUnit = 0;
+            Uniform uniforms[maxUniforms];
+            int uniformCount = 0;
+            // gl calls made and skipped since the counters were last reset
+            unsigned long callsIssued = 0;
+            unsigned long callsSaved = 0;
+
+            void Invalidate() {
+                // Values that can't be a real object name, so the next bind of anything goes through
+                program = vertexArray = arrayBuffer = 0xFFFFFFFF;
+                for (int i = 0; i < maxTextureUnits; i++) {
+                    textures[i] = 0xFFFFFFFF;
+                }
+                activeTextureUnit = 0xFFFFFFFF;
+                for (int i = 0; i < uniformCount; i++) {
+                    uniforms[i].valueCount = 0;
+                }
+            }
+
+            void UseProgram(GLuint newProgram) {
+                if (program == newProgram) { callsSaved++; return; }
+                glUseProgram(newProgram);
+                program = newProgram;
+                callsIssued++;
+            }
+
+            void BindVertexArray(GLuint newVertexArray) {
+                if (vertexArray == newVertexArray) { callsSaved++; return; }
+                glBindVertexArray(newVertexArray);
+                vertexArray = newVertexArray;
+                callsIssued++;
+            }
+
+            void BindArrayBuffer(GLuint newBuffer) {
+                if (arrayBuffer == newBuffer) { callsSaved++; return; }
+                glBindBuffer(GL_ARRAY_BUFFER, newBuffer);
+                arrayBuffer = newBuffer;
+                callsIssued++;
+            }
+
+            void ActiveTexture(GLenum unit) {
+                if (activeTextureUnit == unit) { callsSaved++; return; }
+                glActiveTexture(GL_TEXTURE0 + unit);
+                activeTextureUnit = unit;
+                callsIssued++;
+            }
+
+            // For drawing: makes sure newTexture is bound to unit, which might not be the active unit afterwards if it already was
+            void BindTexture(GLenum unit, GLenum target, GLuint newTexture) {
+                if (textures[unit] == newTexture) { callsSaved++; return; }
+                ActiveTexture(unit);
+                glBindTexture(target, newTexture);
+                textures[unit] = newTexture;
+                callsIssued++;
+            }
+
+            // For glTex* calls: binds newTexture to unit and leaves unit active, so the edit lands on newTexture
+            void BindTextureForEdit(GLenum unit, GLenum target, GLuint newTexture) {
+                ActiveTexture(unit);
+                BindTexture(unit, target, newTexture);
+            }
+
+            // The sprites' texture array always lives in unit 0
+            void BindTexture2DArray(GLuint newTexture) {
+                BindTexture(0, GL_TEXTURE_2D_ARRAY, newTexture);
+            }
+
+            void BindTexture2DArrayForEdit(GLuint newTexture) {
+                BindTextureForEdit(0, GL_TEXTURE_2D_ARRAY, newTexture);
+            }
+
+            // Looks up (once per program and name) the uniform. name is expected to be a string literal or otherwise live forever
+            Uniform* GetUniform(GLuint uniformProgram, const char* name) {
+                for (int i = 0; i < uniformCount; i++) {
+                    if (uniforms[i].program == uniformProgram && (uniforms[i].name == name || lstrcmpA(uniforms[i].name, name) == 0)) {
+                        return &uniforms[i];
+                    }
+                }
+                assert(uniformCount < maxUniforms && "Too many uniforms in the state cache");
+                Uniform* uniform = &uniforms[uniformCount++];
+                uniform->program = uniformProgram;
+                uniform->name = name;
+                uniform->location = glGetUniformLocation(uniformProgram, name);
+                uniform->valueCount = 0;
+                callsIssued++;
+                return uniform;
+            }
+
+            GLint UniformLocation(GLuint uniformProgram, const char* name) {
+                return GetUniform(uniformProgram, name)->location;
+            }
+
+            // True if value is what the uniform already has. Otherwise remembers it
+            bool SameUniformValue(Uniform* uniform, const GLfloat* value, int count) {
+                bool same = uniform->valueCount == count;
+                for (int i = 0; same && i < count; i++) {
+                    same = uniform->value[i] == value[i];
+                }
+                if (same) {
+                    callsSaved++;
+                    return true;
+                }
+                CopyMemory(uniform->value, value, sizeof(GLfloat) * count);
+                uniform->valueCount = count;
+                callsIssued++;
+                return false;
+            }
+
+            // These use the program, since that's where the uniform lives
+            void SetUniformMatrix4(GLuint uniformProgram, const char* name, const GLfloat* matrix) {
+                UseProgram(uniformProgram);
+                Uniform* uniform = GetUniform(uniformProgram, name);
+                if (!SameUniformValue(uniform, matrix, 16)) {
+                    glUniformMatrix4fv(uniform->location, 1, GL_FALSE, matrix);
+                }
+            }
+
+            void SetUniform2(GLuint uniformProgram, const char* name, const GLfloat* vector) {
+                UseProgram(uniformProgram);
+                Uniform* uniform = GetUniform(uniformProgram, name);
+                if (!SameUniformValue(uniform, vector, 2)) {
+                    glUniform2fv(uniform->location, 1, vector);
+                }
+            }
+
+            void SetUniform1(GLuint uniformProgram, const char* name, GLfloat value) {
+                UseProgram(uniformProgram);
+                Uniform* uniform = GetUniform(uniformProgram, name);
+                if (!SameUniformValue(uniform, &value, 1)) {
+                    glUniform1f(uniform->location, value);
+                }
+            }
+
+            // Ints are cached as floats, fine for samplers and anything under 2^24
+            void SetUniform1i(GLuint uniformProgram, const char* name, GLint value) {
+                UseProgram(uniformProgram);
+                Uniform* uniform = GetUniform(uniformProgram, name);
+                GLfloat cached = (GLfloat) value;
+                if (!SameUniformValue(uniform, &cached, 1)) {
+                    glUniform1i(uniform->location, value);
+                }
+            }
+        };
+
         struct Renderer {
             struct Color {
                 float r, g, b, a;
@@ -509,6 +1266,11 @@ namespace Win32 {
                     r = 0.0f; g = 0.0f; b = 0.0f; a = 1.0f;
                     return *this;
                 }
+                // [0, 1] to [0, 255], rounded to nearest and clamped. Every color that gets packed to 8 bits goes through here
+                static unsigned char ToByte(float value) {
+                    value = value * 255.0f + 0.5f;
+                    return (unsigned char) (value < 0.0f ? 0.0f : (value > 255.0f ? 255.0f : value));
+                }
             };
             // TODO: Delete this forward declaration
             struct Point2f;
@@ -546,7 +1308,7 @@ namespace Win32 {
             };
             // Vertex as in "data vertex" in a graphics card
             struct Vertex {
-                static constexpr int componentsNumber = 8;
+                static constexpr int componentsNumber = 9;
                 union {
                     struct {
                         union {
@@ -570,13 +1332,16 @@ namespace Win32 {
                             };
                             Color color;
                         };
+                        // layer of the texture array
+                        float layer;
                     };
                     float data[componentsNumber];
                 };
                 Vertex() { Zero(); }
-                Vertex(Point2f pos, Point2f uv, Color col) : position(pos), texture(uv), color(col) {}
+                Vertex(Point2f pos, Point2f uv, Color col) : position(pos), texture(uv), color(col), layer(0.0f) {}
+                Vertex(Point2f pos, Point2f uv, Color col, int layer) : position(pos), texture(uv), color(col), layer((float)layer) {}
                 Vertex(Vertex&) = default;
-                Vertex(float x, float y, float u, float v, float r, float g, float b, float a) : x(x), y(y), u(u), v(v), r(r), g(g), b(b), a(a) {}
+                Vertex(float x, float y, float u, float v, float r, float g, float b, float a) : x(x), y(y), u(u), v(v), r(r), g(g), b(b), a(a), layer(0.0f) {}
                 // Empties the vertex
                 Vertex Zero() {
                     for(int i = 0; i < componentsNumber; i++) {
@@ -586,11 +1351,82 @@ namespace Win32 {
                 }
                 void Print() {
                     Win32::FormattedPrint(
-                        "Pos {%f, %f} Tex {%f, %f} Col {%f, %f, %f, %f}\n",
-                        x, y, u, v, r, g, b, a
+                        "Pos {%f, %f} Tex {%f, %f} Col {%f, %f, %f, %f} Layer %f\n",
+                        x, y, u, v, r, g, b, a, layer
                     );
                 }
             };
+            // CompactVertex and Instance keep texel coordinates in the low 13 bits of their 16 bit fields (up to 8191, twice the largest
+            // texture array so rects can repeat) and the layer in the 3 bits above them, the low half in u and the high half in v.
+            // Instance uses the same 3 bits of u2 and v2 for a fraction of a texel, CompactVertex rounds to whole texels
+            static const int maxPackedTexel = 8191;
+            static const int maxPackedLayers = 64;
+            static unsigned short PackU(int u, int layer) { return (unsigned short) ((u & maxPackedTexel) | ((layer & 7) << 13)); }
+            static unsigned short PackV(int v, int layer) { return (unsigned short) ((v & maxPackedTexel) | (((layer >> 3) & 7) << 13)); }
+            static int UnpackTexel(unsigned short packed) { return packed & maxPackedTexel; }
+            static int UnpackLayer(unsigned short u, unsigned short v) { return (u >> 13) | ((v >> 13) << 3); }
+            // 12 byte version of Vertex for pixel art: integer pixel positions, integer texel coordinates with the layer packed in
+            // (see PackU) and an RGBA8 color. The attributes are fetched as floats (positions and texels not normalized, color
+            // normalized) so the same vshader works for both, it unpacks the layer when attribute 3 is the constant -1
+            struct CompactVertex {
+                signed short x, y;
+                unsigned short u, v;
+                unsigned char r, g, b, a;
+                CompactVertex() : x(0), y(0), u(0), v(0), r(0), g(0), b(0), a(0) {}
+                CompactVertex(Vertex& vertex) {
+                    int layer = (int) vertex.layer;
+                    x = (signed short) ClampToRange(vertex.x, -32768.0f, 32767.0f);
+                    y = (signed short) ClampToRange(vertex.y, -32768.0f, 32767.0f);
+                    u = PackU((int) ClampToRange(vertex.u, 0.0f, (float) maxPackedTexel), layer);
+                    v = PackV((int) ClampToRange(vertex.v, 0.0f, (float) maxPackedTexel), layer);
+                    r = Color::ToByte(vertex.r);
+                    g = Color::ToByte(vertex.g);
+                    b = Color::ToByte(vertex.b);
+                    a = Color::ToByte(vertex.a);
+                }
+                // Rounds to nearest and clamps to [min, max]
+                static float ClampToRange(float value, float min, float max) {
+                    value = value < 0.0f ? value - 0.5f : value + 0.5f;
+                    return value < min ? min : (value > max ? max : value);
+                }
+            };
+            static_assert(sizeof(CompactVertex) == 12, "CompactVertex is expected to be tightly packed");
+            // What gets uploaded per quad when drawing instanced: vshader_instanced builds the 4 corners out of it with gl_VertexID.
+            // u1 and v1 carry the layer (see PackU), u2 and v2 the eighths of a texel the whole rect is moved by, in the same 3 bits,
+            // so that scrolling can be smoother than a texel. Use U1(), V1(), U2(), V2(), Layer() and SubTexel*() to read them back
+            struct Instance {
+                float x, y;
+                unsigned short w, h;
+                unsigned short u1, v1, u2, v2;
+                unsigned char r, g, b, a;
+                Instance() : x(0.0f), y(0.0f), w(0), h(0), u1(0), v1(0), u2(0), v2(0), r(0), g(0), b(0), a(0) {}
+                void SetTexture(int textureU1, int textureV1, int textureU2, int textureV2, int layer) {
+                    u1 = PackU(textureU1, layer);
+                    v1 = PackV(textureV1, layer);
+                    // Masked like u1 and v1, so that nothing spills into the sub texel bits
+                    u2 = (unsigned short) (textureU2 & maxPackedTexel);
+                    v2 = (unsigned short) (textureV2 & maxPackedTexel);
+                }
+                // Same with texel coordinates that aren't whole: the fraction of textureU1 and textureV1, rounded to eighths, moves the rect
+                void SetTexture(float textureU1, float textureV1, float textureU2, float textureV2, int layer) {
+                    int eighthsU = (int) (textureU1 * 8.0f + 0.5f);
+                    int eighthsV = (int) (textureV1 * 8.0f + 0.5f);
+                    int w = (int) (textureU2 - textureU1 + 0.5f);
+                    int h = (int) (textureV2 - textureV1 + 0.5f);
+                    SetTexture(eighthsU >> 3, eighthsV >> 3, (eighthsU >> 3) + w, (eighthsV >> 3) + h, layer);
+                    u2 = (unsigned short) (u2 | ((eighthsU & 7) << 13));
+                    v2 = (unsigned short) (v2 | ((eighthsV & 7) << 13));
+                }
+                int U1() const { return UnpackTexel(u1); }
+                int V1() const { return UnpackTexel(v1); }
+                int U2() const { return UnpackTexel(u2); }
+                int V2() const { return UnpackTexel(v2); }
+                int Layer() const { return UnpackLayer(u1, v1); }
+                float SubTexelU() const { return (u2 >> 13) / 8.0f; }
+                float SubTexelV() const { return (v2 >> 13) / 8.0f; }
+            };
+            static_assert(sizeof(Instance) == 24, "Instance is expected to be tightly packed");
+            // A rect of texels in one of the layers of the renderer's texture array (see LoadTexture)
             struct Texture {
                 union {
                     struct {
@@ -600,11 +1436,14 @@ namespace Win32 {
                         Point2i topLeft, bottomRight;
                     };
                 };
+                int layer;
                 Texture() { Zero(); }
-                Texture(Point2i topLeft, Point2i bottomRight) : topLeft(topLeft), bottomRight(bottomRight) {}
-                Texture(int u1, int v1, int u2, int v2) : u1(u1), v1(v1), u2(u2), v2(v2) {}
+                Texture(Point2i topLeft, Point2i bottomRight) : topLeft(topLeft), bottomRight(bottomRight), layer(0) {}
+                Texture(Point2i topLeft, Point2i bottomRight, int layer) : topLeft(topLeft), bottomRight(bottomRight), layer(layer) {}
+                Texture(int u1, int v1, int u2, int v2) : u1(u1), v1(v1), u2(u2), v2(v2), layer(0) {}
+                Texture(int u1, int v1, int u2, int v2, int layer) : u1(u1), v1(v1), u2(u2), v2(v2), layer(layer) {}
                 Texture(Texture&) = default;
-                Texture Zero() { u1 = 0; v1 = 0; u2 = 0; v2 = 0; return *this; }
+                Texture Zero() { u1 = 0; v1 = 0; u2 = 0; v2 = 0; layer = 0; return *this; }
             };
             struct Quad {
                 // d___c
@@ -614,12 +1453,20 @@ namespace Win32 {
                 Quad() { Zero(); }
                 Quad(Vertex a, Vertex b, Vertex c, Vertex d) : a(a), b(b), c(c), d(d) {}
                 Quad(Point2f position, Point2i size, Texture texture, Color color) {
-                    d = Vertex(position, texture.topLeft.toPoint2f(), color);
-                    b = Vertex(position + size, texture.bottomRight.toPoint2f(), color);
-                    a = Vertex(Point2f(position.x, position.y + (float)size.y), Point2f((float)texture.topLeft.x, (float)texture.bottomRight.y), color);
-                    c = Vertex(Point2f(position.x + (float)size.x, position.y), Point2f((float)texture.bottomRight.x, (float)texture.topLeft.y), color);
+                    d = Vertex(position, texture.topLeft.toPoint2f(), color, texture.layer);
+                    b = Vertex(position + size, texture.bottomRight.toPoint2f(), color, texture.layer);
+                    a = Vertex(Point2f(position.x, position.y + (float)size.y), Point2f((float)texture.topLeft.x, (float)texture.bottomRight.y), color, texture.layer);
+                    c = Vertex(Point2f(position.x + (float)size.x, position.y), Point2f((float)texture.bottomRight.x, (float)texture.topLeft.y), color, texture.layer);
                 }
                 Quad(Quad&) = default;
+                // Moves the texel coordinates of the 4 corners, for fractions of a texel
+                void MoveTexture(float du, float dv) {
+                    Vertex* corners[] = { &a, &b, &c, &d };
+                    for (int i = 0; i < 4; i++) {
+                        corners[i]->u += du;
+                        corners[i]->v += dv;
+                    }
+                }
                 Quad Zero() {
                     a.Zero();
                     b.Zero();
@@ -634,6 +1481,297 @@ namespace Win32 {
                     d.Print();
                 }
             };
+            // Packs many small RGBA images into a few pages with a skyline bottom-left packer. Every image gets an id, and Get(id) gives
+            // its current rect, with the page index as the layer. Images can be removed, and Defragment() repacks everything that is left,
+            // tallest first, into the least amount of pages; that moves rects around so generation is bumped whenever it happens.
+            // Defragment() is only ever called explicitly (see Renderer::DefragmentAtlas), so rects don't move while they are in use.
+            // Pure cpu, the renderer takes care of uploading the pages (see Renderer::LoadAtlasImage).
+            struct Atlas {
+                struct SkylineNode {
+                    int x, y, width;
+                };
+                struct Page {
+                    unsigned char* pixels;
+                    SkylineNode* nodes;
+                    int nodeCount;
+                    // Set when the pixels change in a way that needs the whole page uploaded again
+                    bool dirty;
+                };
+                struct Entry {
+                    int page;
+                    int x, y, w, h;
+                    bool alive;
+                };
+                int pageWidth = 0;
+                int pageHeight = 0;
+                int pageCount = 0;
+                int pagesUsed = 0;
+                Page* pages = NULL;
+                Entry* entries = NULL;
+                int entryCount = 0;
+                int entryCapacity = 0;
+                // Empty texels left around every image so nearest filtering at the edges never picks a neighbour
+                int padding = 1;
+                int generation = 0;
+                // The image Insert() copied in last, until the renderer uploads it. -1 for none
+                int lastInserted = -1;
+
+                void Initialize(int width, int height, int maxPages) {
+                    pageWidth = width;
+                    pageHeight = height;
+                    pagesUsed = 0;
+                    lastInserted = -1;
+                    pages = (Page*) HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(Page) * maxPages);
+                    // Without pages nothing fits, which Insert() reports
+                    pageCount = pages ? maxPages : 0;
+                }
+
+                static void FreePages(Page* pages, int count) {
+                    for (int p = 0; p < count; p++) {
+                        if (pages[p].pixels) HeapFree(GetProcessHeap(), 0, pages[p].pixels);
+                        if (pages[p].nodes) HeapFree(GetProcessHeap(), 0, pages[p].nodes);
+                    }
+                    HeapFree(GetProcessHeap(), 0, pages);
+                }
+
+                // Frees the pages and the entries, Initialize() has to be called again before using it
+                void Release() {
+                    if (pages) FreePages(pages, pageCount);
+                    if (entries) HeapFree(GetProcessHeap(), 0, entries);
+                    pages = NULL;
+                    entries = NULL;
+                    pageCount = pagesUsed = 0;
+                    entryCount = entryCapacity = 0;
+                    lastInserted = -1;
+                }
+
+                // False if the page couldn't be allocated
+                bool ResetPage(Page& page) {
+                    if (!page.pixels) {
+                        page.pixels = (unsigned char*) HeapAlloc(GetProcessHeap(), 0, pageWidth * pageHeight * 4);
+                    }
+                    if (!page.nodes) {
+                        // A skyline never has more nodes than texels in a row
+                        page.nodes = (SkylineNode*) HeapAlloc(GetProcessHeap(), 0, sizeof(SkylineNode) * (pageWidth + 1));
+                    }
+                    if (!page.pixels || !page.nodes) {
+                        return false;
+                    }
+                    ZeroMemory(page.pixels, pageWidth * pageHeight * 4);
+                    page.nodes[0].x = 0;
+                    page.nodes[0].y = 0;
+                    page.nodes[0].width = pageWidth;
+                    page.nodeCount = 1;
+                    page.dirty = true;
+                    return true;
+                }
+
+                // Finds the lowest (then leftmost) spot of the skyline where a w x h rect fits. Returns the node it starts at or -1
+                int FindPosition(Page& page, int w, int h, int* bestX, int* bestY) {
+                    int bestIndex = -1;
+                    int bestWidth = 0;
+                    *bestY = pageHeight;
+                    for (int i = 0; i < page.nodeCount; i++) {
+                        int x = page.nodes[i].x;
+                        if (x + w > pageWidth) {
+                            break;
+                        }
+                        int y = 0;
+                        int widthLeft = w;
+                        for (int j = i; widthLeft > 0; j++) {
+                            if (page.nodes[j].y > y) y = page.nodes[j].y;
+                            widthLeft -= page.nodes[j].width;
+                        }
+                        if (y + h > pageHeight) {
+                            continue;
+                        }
+                        if (y < *bestY || (y == *bestY && page.nodes[i].width < bestWidth)) {
+                            bestIndex = i;
+                            bestWidth = page.nodes[i].width;
+                            *bestX = x;
+                            *bestY = y;
+                        }
+                    }
+                    return bestIndex;
+                }
+
+                // Raises the skyline over the rect just placed at node index
+                void AddSkylineLevel(Page& page, int index, int x, int y, int w, int h) {
+                    for (int i = page.nodeCount; i > index; i--) {
+                        page.nodes[i] = page.nodes[i - 1];
+                    }
+                    page.nodes[index].x = x;
+                    page.nodes[index].y = y + h;
+                    page.nodes[index].width = w;
+                    page.nodeCount++;
+                    // Cut the nodes that are now under the new one
+                    for (int i = index + 1; i < page.nodeCount; i++) {
+                        SkylineNode& previous = page.nodes[i - 1];
+                        int previousEnd = previous.x + previous.width;
+                        if (page.nodes[i].x >= previousEnd) {
+                            break;
+                        }
+                        int shrink = previousEnd - page.nodes[i].x;
+                        page.nodes[i].x += shrink;
+                        page.nodes[i].width -= shrink;
+                        if (page.nodes[i].width > 0) {
+                            break;
+                        }
+                        for (int j = i; j < page.nodeCount - 1; j++) {
+                            page.nodes[j] = page.nodes[j + 1];
+                        }
+                        page.nodeCount--;
+                        i--;
+                    }
+                    // Merge neighbours at the same height
+                    for (int i = 0; i < page.nodeCount - 1; i++) {
+                        if (page.nodes[i].y == page.nodes[i + 1].y) {
+                            page.nodes[i].width += page.nodes[i + 1].width;
+                            for (int j = i + 1; j < page.nodeCount - 1; j++) {
+                                page.nodes[j] = page.nodes[j + 1];
+                            }
+                            page.nodeCount--;
+                            i--;
+                        }
+                    }
+                }
+
+                // Finds room for a w x h image in the pages in use, opening a new page if needed. False when there's no room anywhere
+                bool Place(int w, int h, int* page, int* x, int* y) {
+                    int paddedW = w + padding * 2;
+                    int paddedH = h + padding * 2;
+                    if (paddedW > pageWidth || paddedH > pageHeight) {
+                        // Images exactly as big as a page go in without padding
+                        if (w > pageWidth || h > pageHeight) return false;
+                        paddedW = w;
+                        paddedH = h;
+                    }
+                    for (int p = 0; p <= pagesUsed && p < pageCount; p++) {
+                        if (p == pagesUsed) {
+                            if (!ResetPage(pages[p])) return false;
+                            pagesUsed++;
+                        }
+                        int nodeX, nodeY;
+                        int node = FindPosition(pages[p], paddedW, paddedH, &nodeX, &nodeY);
+                        if (node >= 0) {
+                            AddSkylineLevel(pages[p], node, nodeX, nodeY, paddedW, paddedH);
+                            *page = p;
+                            *x = nodeX + (paddedW - w) / 2;
+                            *y = nodeY + (paddedH - h) / 2;
+                            return true;
+                        }
+                    }
+                    return false;
+                }
+
+                void CopyPixels(const unsigned char* source, int sourceStride, Page& page, int x, int y, int w, int h) {
+                    for (int row = 0; row < h; row++) {
+                        CopyMemory(page.pixels + ((y + row) * pageWidth + x) * 4, source + row * sourceStride, w * 4);
+                    }
+                }
+
+                // Packs the image and copies it into its page. Returns its id, or -1 if it doesn't fit (try Defragment() and again)
+                int Insert(const void* rgba, int w, int h) {
+                    if (entryCount == entryCapacity) {
+                        // Grown before placing, so that running out of memory doesn't leave a rect taken by nothing
+                        int capacity = entryCapacity ? entryCapacity * 2 : 256;
+                        Entry* grown = entries
+                            ? (Entry*) HeapReAlloc(GetProcessHeap(), 0, entries, sizeof(Entry) * capacity)
+                            : (Entry*) HeapAlloc(GetProcessHeap(), 0, sizeof(Entry) * capacity);
+                        if (!grown) {
+                            return -1;
+                        }
+                        entries = grown;
+                        entryCapacity = capacity;
+                    }
+                    int page, x, y;
+                    if (!Place(w, h, &page, &x, &y)) {
+                        return -1;
+                    }
+                    CopyPixels((const unsigned char*) rgba, w * 4, pages[page], x, y, w, h);
+                    lastInserted = entryCount;
+                    Entry& entry = entries[entryCount];
+                    entry.page = page;
+                    entry.x = x;
+                    entry.y = y;
+                    entry.w = w;
+                    entry.h = h;
+                    entry.alive = true;
+                    return entryCount++;
+                }
+
+                // The space is only given back on the next Defragment()
+                void Remove(int id) {
+                    entries[id].alive = false;
+                }
+
+                Texture Get(int id) {
+                    Entry& entry = entries[id];
+                    return Texture(entry.x, entry.y, entry.x + entry.w, entry.y + entry.h, entry.page);
+                }
+
+                // Repacks every live image from scratch, tallest first, which is both tighter than the incremental packing and
+                // reclaims the space of removed images. Returns false if they don't fit anymore (nothing is changed then)
+                bool Defragment() {
+                    HANDLE heap = GetProcessHeap();
+                    int* order = (int*) HeapAlloc(heap, 0, sizeof(int) * (entryCount + 1));
+                    Entry* placed = (Entry*) HeapAlloc(heap, 0, sizeof(Entry) * (entryCount + 1));
+                    Page* newPages = (Page*) HeapAlloc(heap, HEAP_ZERO_MEMORY, sizeof(Page) * pageCount);
+                    if (!order || !placed || !newPages) {
+                        if (order) HeapFree(heap, 0, order);
+                        if (placed) HeapFree(heap, 0, placed);
+                        if (newPages) HeapFree(heap, 0, newPages);
+                        return false;
+                    }
+                    // Sort the live entries by height, tallest first (insertion sort over the indices, entry counts are small)
+                    int liveCount = 0;
+                    for (int i = 0; i < entryCount; i++) {
+                        if (!entries[i].alive) continue;
+                        int j = liveCount++;
+                        while (j > 0 && entries[order[j - 1]].h < entries[i].h) {
+                            order[j] = order[j - 1];
+                            j--;
+                        }
+                        order[j] = i;
+                    }
+                    // Pack into a fresh set of pages, keeping the old ones around to copy the pixels from
+                    Page* oldPages = pages;
+                    int oldPagesUsed = pagesUsed;
+                    pages = newPages;
+                    pagesUsed = 0;
+                    bool fits = true;
+                    for (int i = 0; i < liveCount && fits; i++) {
+                        Entry& entry = entries[order[i]];
+                        placed[order[i]] = entry;
+                        fits = Place(entry.w, entry.h, &placed[order[i]].page, &placed[order[i]].x, &placed[order[i]].y);
+                    }
+                    int newPagesUsed = pagesUsed;
+                    if (fits) {
+                        for (int i = 0; i < liveCount; i++) {
+                            Entry& from = entries[order[i]];
+                            Entry& to = placed[order[i]];
+                            Page& source = oldPages[from.page];
+                            CopyPixels(source.pixels + (from.y * pageWidth + from.x) * 4, pageWidth * 4, newPages[to.page], to.x, to.y, to.w, to.h);
+                            from = to;
+                        }
+                        pages = newPages;
+                        pagesUsed = newPagesUsed;
+                        generation++;
+                        // Everything is on new pages now, which get uploaded whole
+                        lastInserted = -1;
+                    }
+                    else {
+                        pages = oldPages;
+                        pagesUsed = oldPagesUsed;
+                    }
+                    // Free whichever set of pages lost
+                    FreePages(fits ? oldPages : newPages, pageCount);
+                    HeapFree(heap, 0, placed);
+                    HeapFree(heap, 0, order);
+                    return fits;
+                }
+            };
+
             // What OpenGL works with...
             // Screen                 Textures
             // (-1, 1)_____( 1, 1)    ( 0, 1)_____( 1, 1)
@@ -648,12 +1786,23 @@ namespace Win32 {
             // |                 |    |                 |    0___1
             // ( 0, 1)_____( 1, 1)    ( 0, 1)_____( 1, 1)
 
-            static constexpr unsigned long maxQuads = 1000;
-            static constexpr unsigned long maxVertices = maxQuads * 4;
-            static constexpr unsigned long maxIndices = maxQuads * 6;
+            // The batch starts with room for defaultBatchQuads quads. When it fills up it either grows (doubling, up to maxBatchQuads)
+            // or, once it can't grow anymore, flushes what it has with a draw call and keeps going. So a scene of any size renders,
+            // just in more than one draw call. Check lastFrameStats.flushes to tune the batch size.
+            static constexpr unsigned long defaultBatchQuads = 1000;
+            unsigned long batchCapacity = 0;
+            unsigned long maxBatchQuads = 16384;
+            bool growBatch = true;
             GLfloat textureDimensions[2];
             unsigned long quadsToRender = 0;
 
+            // Every texture loaded goes into a single GL_TEXTURE_2D_ARRAY, so quads using different textures still end up in the
+            // same draw call. The layers are the pages of atlas, so small images get packed together in the same layer.
+            // The size of the array is fixed at Initialize, set these before that to fit the biggest texture that will be loaded.
+            GLsizei textureArrayWidth = 256;
+            GLsizei textureArrayHeight = 256;
+            GLsizei textureArrayLayers = 16;
+            Atlas atlas;
             GLuint textureObject = 0;
             GLuint vertexArrayObject = 0;
             GLuint elementBufferObject = 0;
@@ -661,32 +1810,335 @@ namespace Win32 {
             GLuint vertexShaderObject = 0;
             GLuint fragmentShaderObject = 0;
             GLuint shaderProgramObject = 0;
+            GLuint instancedProgramObject = 0;
+            GLuint tilemapProgramObject = 0;
+            // Bound for draws that don't read any vertex attribute (gl wants a vertex array object bound anyway)
+            GLuint emptyVertexArrayObject = 0;
 
-            
-            Vertex vertexBuffer[maxVertices];
+            // Every bind and uniform of the renderer goes through here
+            StateCache state;
 
-            bool textureLoaded = false;
+            // The vertex stream. When the context has ARB_buffer_storage it's a single buffer split in streamRegions regions of one batch
+            // each, mapped once and for all, and AddQuad writes straight into the mapping. Every flush fences its region and moves on to the
+            // next one, waiting for the gpu to be done with it if it has to. Without ARB_buffer_storage AddQuad writes into vertexStaging
+            // instead and Flush orphans the buffer and uploads it with glBufferSubData.
+            static constexpr int streamRegions = 3;
+            // Set to false before Initialize to force the fallback
+            bool usePersistentStream = true;
+            // Format of the vertices in the stream. Set before Initialize or change it with SetVertexLayout
+            enum vertexLayout {
+                FloatVertices,   // 4 Vertex per quad, 128 bytes
+                CompactVertices, // 4 CompactVertex per quad, 48 bytes
+                Instances        // 1 Instance per quad, 24 bytes, needs LoadInstancedShaders
+            };
+            vertexLayout layout = FloatVertices;
+            // Batches of up to 65536 vertices are indexed with 16 bit indices
+            GLenum indexType = GL_UNSIGNED_INT;
+            bool persistentStream = false;
+            unsigned char* streamMapping = NULL;
+            GLsync streamFences[streamRegions] = {};
+            int streamRegion = 0;
+            // batchCapacity * 4 vertices, only used by the fallback path
+            unsigned char* vertexStaging = NULL;
+            // Where AddQuad writes the batch, either the current region of streamMapping or vertexStaging
+            unsigned char* vertexBuffer = NULL;
 
-            enum shaderType {
-                FragmentShader,
-                VertexShader
+
+            // Per frame counters. stats is the frame being built, lastFrameStats the last one that was Render()ed
+            struct FrameStats {
+                unsigned long quads;
+                unsigned long flushes;
+                // Times a flush had to wait on the gpu to release a region of the vertex stream
+                unsigned long streamWaits;
+                // Draw calls of any kind, and program or texture switches between them
+                unsigned long drawCalls;
+                unsigned long stateChanges;
+                // Commands that went through the sorted queue (Submit)
+                unsigned long commands;
+                // Binds, program and uniform changes that reached gl, and the ones the state cache skipped
+                unsigned long glCallsIssued;
+                unsigned long glCallsSaved;
+                // Quads drawn from static layers, and how many of those had to be uploaded again this frame
+                unsigned long staticQuads;
+                unsigned long staticQuadsUploaded;
+                // Glyphs added with AddText, and the strings among them that weren't in the text cache
+                unsigned long glyphs;
+                unsigned long textLayouts;
+                // Quads that were outside of the cull rect and never made it to the batch (the ones that did are in quads)
+                unsigned long culled;
+                // Quads that came from recording contexts
+                unsigned long recorded;
+                FrameStats() : quads(0), flushes(0), streamWaits(0), drawCalls(0), stateChanges(0), commands(0), glCallsIssued(0), glCallsSaved(0), staticQuads(0), staticQuadsUploaded(0), glyphs(0), textLayouts(0), culled(0), recorded(0) {}
             };
+            FrameStats stats;
+            FrameStats lastFrameStats;
 
-            void LoadShader(const char* shaderSource, unsigned long sourceSize, shaderType type) {
-                if (type == shaderType::FragmentShader) {
-                    fragmentShaderObject = glCreateShader(GL_FRAGMENT_SHADER);
-                    glShaderSource(fragmentShaderObject, 1, &shaderSource, NULL);
-                    glCompileShader(fragmentShaderObject);
-                    int success;
-                    glGetShaderiv(fragmentShaderObject, GL_COMPILE_STATUS, &success);
-                    if(success == 0) {
-                        char info[512];
-                        glGetShaderInfoLog(fragmentShaderObject, 512, NULL, info);
-                        FormattedPrint("Error compiling fragment shader:\n\t%s", info);
-                    }
-                }
-                else if (type == shaderType::VertexShader) {
-                    vertexShaderObject = glCreateShader(GL_VERTEX_SHADER);
+            // Set by BeginFrame, which also clears the screen, so that quads flushed halfway through the frame don't get cleared afterwards
+            bool frameBegun = false;
+            GLfloat projectionMatrix[16];
+            GLfloat viewportSize[2];
+
+            // Quads that don't overlap the cull rect (left, top, right, bottom) are dropped before they reach the batch. BeginFrame sets
+            // it to the viewport, intersected with the camera rect if there is one (SetCameraRect)
+            bool cullQuads = true;
+            GLfloat cullRect[4];
+            bool useCameraRect = false;
+            GLfloat cameraRect[4];
+
+            // Programs and textures that draw commands can refer to by id. Id 0 is always the default one: the program of the current
+            // vertex layout and textureObject. Get more ids with RegisterProgram and RegisterTexture
+            static constexpr int maxPrograms = 256;
+            static constexpr int maxTextures = 256;
+            struct TextureSlot {
+                GLuint object;
+                GLfloat dimensions[2];
+            };
+            GLuint programTable[maxPrograms] = {};
+            TextureSlot textureTable[maxTextures] = {};
+            int programCount = 1;
+            int textureCount = 1;
+            // What the batch is being drawn with
+            unsigned char currentProgram = 0;
+            unsigned short currentTexture = 0;
+
+            // The draw command queue. Every Submit()ted quad carries a 64 bit key:
+            // . bits 56-63 layer, 48-55 program id, 32-47 texture id, 0-31 depth
+            // At Render the commands are radix sorted by key (stable, so equal keys keep the submission order) and drawn in that order,
+            // breaking the batch only where the program or the texture changes.
+            struct DrawCommand {
+                unsigned long long key;
+                unsigned int instance;
+            };
+            DrawCommand* commands = NULL;
+            DrawCommand* commandsScratch = NULL;
+            Instance* commandInstances = NULL;
+            unsigned long commandCount = 0;
+            unsigned long commandCapacity = 0;
+
+            // Static layers are sets of quads that get uploaded once into their own GL_STATIC_DRAW buffer and are then drawn with a
+            // single draw call, with no cpu work per quad, until something changes them (which marks them dirty and reuploads them once).
+            // They are kept as Vertex (FloatVertices) whatever the layout of the stream is. Each one has its own transform that
+            // goes into the mvp uniform, so scrolling them doesn't touch their vertices.
+            static constexpr int maxStaticLayers = 32;
+            struct StaticLayer {
+                GLuint vertexArray;
+                GLuint vertexBuffer;
+                GLuint elementBuffer;
+                GLenum indexType;
+                // cpu copy of the quads, so they can be reuploaded when the layer changes
+                Instance* quads;
+                unsigned long quadCount;
+                unsigned long quadCapacity;
+                // How many quads the gpu buffers have room for
+                unsigned long uploadedCapacity;
+                bool dirty;
+                GLfloat offset[2];
+                GLfloat scale[2];
+            };
+            StaticLayer staticLayers[maxStaticLayers] = {};
+            int staticLayerCount = 0;
+
+            // Tilemaps keep the map in an integer texture, one uint16 per cell (0 empty, n is tile n - 1 of the tileset, counting
+            // left to right, top to bottom), and are drawn with one full screen triangle that looks the tiles up in the fragment shader.
+            // So the cpu cost and the upload volume don't depend on the size of the map, only edits get uploaded (SetTiles).
+            static constexpr int maxTilemaps = 8;
+            struct Tilemap {
+                GLuint indexTexture;
+                int width, height;
+                // The tiles are tileWidth x tileHeight cells of this rect of the texture array
+                Texture tileset;
+                int tileWidth, tileHeight;
+                GLfloat offset[2];
+                GLfloat scale;
+            };
+            Tilemap tilemaps[maxTilemaps] = {};
+            int tilemapCount = 0;
+
+            // A fixed grid of glyphWidth x glyphHeight glyphs in a rect of the texture array, in the order of their character codes,
+            // starting at firstCharacter. The embedded font (texture_font_data) is 16x16 glyphs of 8x8 starting at 0
+            struct Font {
+                Texture texture;
+                int glyphWidth, glyphHeight;
+                int columns;
+                unsigned char firstCharacter;
+                Font() : glyphWidth(0), glyphHeight(0), columns(0), firstCharacter(0) {}
+                Font(Texture texture, int glyphWidth, int glyphHeight, unsigned char firstCharacter = 0)
+                    : texture(texture), glyphWidth(glyphWidth), glyphHeight(glyphHeight), columns((texture.u2 - texture.u1) / glyphWidth), firstCharacter(firstCharacter) {}
+            };
+
+            // Strings already turned into glyph instances, relative to the position of the text and without color, so that HUD text that
+            // doesn't change isn't laid out again every frame. Direct mapped on a hash of the string, the font and the scale, a string
+            // that lands on a used slot just takes it over.
+            struct TextCache {
+                static constexpr int slotCount = 128;
+                struct TextRun {
+                    unsigned long long key;
+                    int length;
+                    Instance* glyphs;
+                    int glyphCount;
+                    int glyphCapacity;
+                };
+                TextRun runs[slotCount] = {};
+                // Layouts since the cache was created, FrameStats::textLayouts has the ones of the frame
+                unsigned long layouts = 0;
+
+                static unsigned long long Hash(const char* text, int length, const Font& font, int scale) {
+                    // FNV-1a
+                    unsigned long long hash = 14695981039346656037ull;
+                    for (int i = 0; i < length; i++) {
+                        hash = (hash ^ (unsigned char) text[i]) * 1099511628211ull;
+                    }
+                    int fontFields[] = { font.texture.u1, font.texture.v1, font.texture.layer, font.glyphWidth, font.glyphHeight, font.firstCharacter, scale };
+                    for (int i = 0; i < (int) (sizeof(fontFields) / sizeof(fontFields[0])); i++) {
+                        hash = (hash ^ (unsigned int) fontFields[i]) * 1099511628211ull;
+                    }
+                    return hash;
+                }
+
+                // Returns the laid out run for text, laying it out if it isn't cached. '\n' starts a new line, spaces and characters
+                // outside of the font take the space of a glyph but don't make one
+                TextRun* Get(const char* text, const Font& font, int scale) {
+                    int length = lstrlenA(text);
+                    unsigned long long key = Hash(text, length, font, scale);
+                    TextRun* run = &runs[key % slotCount];
+                    if (run->glyphs && run->key == key && run->length == length) {
+                        return run;
+                    }
+                    layouts++;
+                    if (run->glyphCapacity < length) {
+                        run->glyphs = run->glyphs
+                            ? (Instance*) HeapReAlloc(GetProcessHeap(), 0, run->glyphs, sizeof(Instance) * length)
+                            : (Instance*) HeapAlloc(GetProcessHeap(), 0, sizeof(Instance) * (length ? length : 1));
+                        assert(run->glyphs && "Couldn't allocate the glyphs of a text run");
+                        run->glyphCapacity = length;
+                    }
+                    run->key = key;
+                    run->length = length;
+                    run->glyphCount = 0;
+                    int glyphCount = font.columns * ((font.texture.v2 - font.texture.v1) / font.glyphHeight);
+                    int column = 0;
+                    int line = 0;
+                    for (int i = 0; i < length; i++) {
+                        unsigned char character = (unsigned char) text[i];
+                        if (character == '\n') {
+                            column = 0;
+                            line++;
+                            continue;
+                        }
+                        int glyph = character - font.firstCharacter;
+                        if (character != ' ' && glyph >= 0 && glyph < glyphCount) {
+                            Instance& instance = run->glyphs[run->glyphCount++];
+                            instance = Instance();
+                            instance.x = (float) (column * font.glyphWidth * scale);
+                            instance.y = (float) (line * font.glyphHeight * scale);
+                            instance.w = (unsigned short) (font.glyphWidth * scale);
+                            instance.h = (unsigned short) (font.glyphHeight * scale);
+                            int u = font.texture.u1 + (glyph % font.columns) * font.glyphWidth;
+                            int v = font.texture.v1 + (glyph / font.columns) * font.glyphHeight;
+                            instance.SetTexture(u, v, u + font.glyphWidth, v + font.glyphHeight, font.texture.layer);
+                        }
+                        column++;
+                    }
+                    return run;
+                }
+            };
+            TextCache textCache;
+
+            // Quads as structure of arrays for AddQuads. Quad i is at (x[i], y[i]) with size (w[i], h[i]), shows rects[rect[i]] and is
+            // tinted with color[i] (r in the lowest byte)
+            struct QuadSpan {
+                unsigned long count;
+                const float* x;
+                const float* y;
+                const float* w;
+                const float* h;
+                const unsigned short* rect;
+                const unsigned int* color;
+                const Texture* rects;
+            };
+
+            // Quads recorded away from the gl thread. Each worker fills its own context (no locking), and at Render the contexts are
+            // copied into the vertex stream in index order, so the result doesn't depend on which thread finished first
+            static constexpr int maxRecordingContexts = 32;
+            struct RecordingContext {
+                Instance* instances = 0;
+                unsigned long count = 0;
+                unsigned long capacity = 0;
+                bool cull = false;
+                GLfloat cullRect[4];
+                unsigned long culled = 0;
+                // Where this context starts in the stitched stream, set by PrefixSumRecordings
+                unsigned long first = 0;
+
+                void Reserve(unsigned long extra) {
+                    if (count + extra <= capacity) {
+                        return;
+                    }
+                    unsigned long newCapacity = capacity ? capacity * 2 : 4096;
+                    while (newCapacity < count + extra) newCapacity *= 2;
+                    instances = instances
+                        ? (Instance*) HeapReAlloc(GetProcessHeap(), 0, instances, sizeof(Instance) * newCapacity)
+                        : (Instance*) HeapAlloc(GetProcessHeap(), 0, sizeof(Instance) * newCapacity);
+                    assert(instances && "Couldn't grow a recording context");
+                    capacity = newCapacity;
+                }
+
+                void AddSprite(Point2f position, Point2i size, Texture texture, Color color) {
+                    if (cull && !(position.x < cullRect[2] && position.x + size.x > cullRect[0] && position.y < cullRect[3] && position.y + size.y > cullRect[1])) {
+                        culled++;
+                        return;
+                    }
+                    Reserve(1);
+                    instances[count++] = MakeInstance(position, size, texture, color);
+                }
+
+                void AddInstance(const Instance& instance) {
+                    if (cull && !(instance.x < cullRect[2] && instance.x + instance.w > cullRect[0] && instance.y < cullRect[3] && instance.y + instance.h > cullRect[1])) {
+                        culled++;
+                        return;
+                    }
+                    Reserve(1);
+                    instances[count++] = instance;
+                }
+
+                void AddQuads(const QuadSpan& span) {
+                    Reserve(span.count);
+                    unsigned long written = WriteInstances(instances + count, span, 0, span.count, cull ? cullRect : 0);
+                    culled += span.count - written;
+                    count += written;
+                }
+            };
+            RecordingContext recordings[maxRecordingContexts];
+            int recordingCount = 0;
+            // Used to copy the recordings into the stream in parallel, optional
+            ThreadPool* pool = 0;
+
+            static unsigned long long MakeSortKey(unsigned char layer, unsigned char program, unsigned short texture, unsigned int depth) {
+                return ((unsigned long long) layer << 56) | ((unsigned long long) program << 48) | ((unsigned long long) texture << 32) | depth;
+            }
+            static unsigned char SortKeyProgram(unsigned long long key) { return (unsigned char) (key >> 48); }
+            static unsigned short SortKeyTexture(unsigned long long key) { return (unsigned short) (key >> 32); }
+
+            enum shaderType {
+                FragmentShader,
+                VertexShader
+            };
+
+            void LoadShader(const char* shaderSource, unsigned long sourceSize, shaderType type) {
+                if (type == shaderType::FragmentShader) {
+                    fragmentShaderObject = glCreateShader(GL_FRAGMENT_SHADER);
+                    glShaderSource(fragmentShaderObject, 1, &shaderSource, NULL);
+                    glCompileShader(fragmentShaderObject);
+                    int success;
+                    glGetShaderiv(fragmentShaderObject, GL_COMPILE_STATUS, &success);
+                    if(success == 0) {
+                        char info[512];
+                        glGetShaderInfoLog(fragmentShaderObject, 512, NULL, info);
+                        FormattedPrint("Error compiling fragment shader:\n\t%s", info);
+                    }
+                }
+                else if (type == shaderType::VertexShader) {
+                    vertexShaderObject = glCreateShader(GL_VERTEX_SHADER);
                     glShaderSource(vertexShaderObject, 1, &shaderSource, NULL);
                     glCompileShader(vertexShaderObject);
                     int success;
@@ -697,136 +2149,1941 @@ namespace Win32 {
                         FormattedPrint("Error compiling vertex shader:\n\t%s", info);
                     }
                 }
-                GetErrors(__FUNCTION__);
+                GetErrors(__FUNCTION__);
+            }
+
+            // Links the last loaded vertex and fragment shaders into a program
+            GLuint LinkShaderProgram() {
+                GLuint program = glCreateProgram();
+                glAttachShader(program, vertexShaderObject);
+                glAttachShader(program, fragmentShaderObject);
+                glLinkProgram(program);
+                int success;
+                glGetProgramiv(program, GL_LINK_STATUS, &success);
+                if(success == 0) {
+                    char info[512];
+                    glGetProgramInfoLog(program, 512, NULL, info);
+                    FormattedPrint("Error linking shader program:\n\t%s", info);
+                }
+                glDeleteShader(vertexShaderObject);
+                glDeleteShader(fragmentShaderObject);
+                GetErrors(__FUNCTION__);
+                return program;
+            }
+
+            void GenerateShaderProgram() {
+                shaderProgramObject = LinkShaderProgram();
+            }
+
+            // Makes a linked program usable from sort keys. It has to take the same inputs as the default program of the layout it's used with
+            unsigned char RegisterProgram(GLuint program) {
+                assert(programCount < maxPrograms && "Too many programs registered");
+                programTable[programCount] = program;
+                return (unsigned char) programCount++;
+            }
+
+            // Makes a texture usable from sort keys. It has to be a GL_TEXTURE_2D_ARRAY
+            unsigned short RegisterTexture(GLuint texture, GLsizei w, GLsizei h) {
+                assert(textureCount < maxTextures && "Too many textures registered");
+                textureTable[textureCount].object = texture;
+                textureTable[textureCount].dimensions[0] = (GLfloat) w;
+                textureTable[textureCount].dimensions[1] = (GLfloat) h;
+                return (unsigned short) textureCount++;
+            }
+
+            // The program used by DrawTilemap (vshader_tilemap + fshader_tilemap)
+            void LoadTilemapShaders(const char* vertexSource, unsigned long vertexSourceSize, const char* fragmentSource, unsigned long fragmentSourceSize) {
+                LoadShader(fragmentSource, fragmentSourceSize, shaderType::FragmentShader);
+                LoadShader(vertexSource, vertexSourceSize, shaderType::VertexShader);
+                tilemapProgramObject = LinkShaderProgram();
+            }
+
+            // The program used by the Instances layout (vshader_instanced + fshader)
+            void LoadInstancedShaders(const char* vertexSource, unsigned long vertexSourceSize, const char* fragmentSource, unsigned long fragmentSourceSize) {
+                LoadShader(fragmentSource, fragmentSourceSize, shaderType::FragmentShader);
+                LoadShader(vertexSource, vertexSourceSize, shaderType::VertexShader);
+                instancedProgramObject = LinkShaderProgram();
+            }
+            
+            // Packs an RGBA image into the atlas and uploads it. Returns the atlas id, or -1 if it doesn't fit (DefragmentAtlas() might
+            // make room). Use atlas.Get(id) for its Texture, which only changes when DefragmentAtlas() is called
+            int LoadAtlasImage(const void* data, GLsizei w, GLsizei h) {
+                int id = atlas.Insert(data, w, h);
+                if (id >= 0) {
+                    UploadAtlas();
+                }
+                GetErrors(__FUNCTION__);
+                return id;
+            }
+
+            // Repacks the atlas (see Atlas::Defragment) and uploads it again. Every Texture taken from it before is stale afterwards,
+            // get them again with atlas.Get(id). Never called behind the caller's back
+            bool DefragmentAtlas() {
+                if (!atlas.Defragment()) {
+                    return false;
+                }
+                UploadAtlas();
+                GetErrors(__FUNCTION__);
+                return true;
+            }
+
+            // Uploads the pages that changed as a whole (new or defragmented) and marks them clean.
+            // The image inserted last goes on its own, as a sub rectangle, unless its page was just uploaded whole
+            void UploadAtlas() {
+                state.BindTexture2DArrayForEdit(textureObject);
+                int id = atlas.lastInserted;
+                atlas.lastInserted = -1;
+                for (int p = 0; p < atlas.pagesUsed; p++) {
+                    Atlas::Page& page = atlas.pages[p];
+                    if (page.dirty) {
+                        glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, p, atlas.pageWidth, atlas.pageHeight, 1, GL_RGBA, GL_UNSIGNED_BYTE, page.pixels);
+                        page.dirty = false;
+                        if (id >= 0 && atlas.entries[id].page == p) id = -1;
+                    }
+                }
+                if (id >= 0 && atlas.entries[id].alive && atlas.entries[id].page < atlas.pagesUsed && atlas.pages[atlas.entries[id].page].pixels) {
+                    Atlas::Entry& last = atlas.entries[id];
+                    const unsigned char* pixels = atlas.pages[last.page].pixels + (last.y * atlas.pageWidth + last.x) * 4;
+                    glPixelStorei(GL_UNPACK_ROW_LENGTH, atlas.pageWidth);
+                    glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, last.x, last.y, last.page, last.w, last.h, 1, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+                    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+                }
+            }
+
+            // Packs an RGBA image into the texture array and returns the Texture covering it.
+            // The rect stays valid until DefragmentAtlas() is called
+            Texture LoadTexture(void* data, GLsizei w, GLsizei h) {
+                int id = LoadAtlasImage(data, w, h);
+                assert(id >= 0 && "The texture array is full");
+                return atlas.Get(id);
+            }
+
+            // (Re)generates a static index buffer so that it covers quadCapacity quads and returns the type of its indices.
+            // Expects the vertex array object that uses it to be bound
+            GLenum UploadIndices(GLuint buffer, unsigned long quadCapacity) {
+                unsigned long indexCount = quadCapacity * 6;
+                GLenum indexType = (quadCapacity * 4 <= 65536) ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
+                unsigned long indexSize = (indexType == GL_UNSIGNED_SHORT) ? sizeof(unsigned short) : sizeof(unsigned int);
+                void* indices = HeapAlloc(GetProcessHeap(), 0, indexSize * indexCount);
+                for (unsigned long i = 0; i < quadCapacity; i++) {
+                    unsigned int vertex = i * 4; // 4 vertices per quad
+                    unsigned long index = i * 6; // 6 indices per quad
+                    unsigned int quadIndices[6] = { vertex + 0, vertex + 1, vertex + 2, vertex + 0, vertex + 2, vertex + 3 };
+                    for (int j = 0; j < 6; j++) {
+                        if (indexType == GL_UNSIGNED_SHORT) {
+                            ((unsigned short*) indices)[index + j] = (unsigned short) quadIndices[j];
+                        }
+                        else {
+                            ((unsigned int*) indices)[index + j] = quadIndices[j];
+                        }
+                    }
+                }
+                glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, buffer);
+                glBufferData(GL_ELEMENT_ARRAY_BUFFER, indexSize * indexCount, indices, GL_STATIC_DRAW);
+                HeapFree(GetProcessHeap(), 0, indices);
+                return indexType;
+            }
+
+            // Vertical sync is up to the caller (wglSwapIntervalEXT, see FramePacer)
+            void Initialize() {
+                // Configure textures
+                // Load them later with LoadTexture()
+                // Texel coordinates and layers have to fit the bits they get packed in (see PackU), rects can repeat up to twice the size
+                assert(textureArrayWidth * 2 - 1 <= maxPackedTexel && textureArrayHeight * 2 - 1 <= maxPackedTexel && "The texture array is too big");
+                assert(textureArrayLayers <= maxPackedLayers && "The texture array has too many layers");
+                glGenTextures(1, &textureObject);
+                state.BindTexture2DArrayForEdit(textureObject);
+                glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+                glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+                glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RGBA8, textureArrayWidth, textureArrayHeight, textureArrayLayers, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+                // Texel coordinates are divided by the size of the array, not by the size of the image in the layer
+                textureDimensions[0] = (GLfloat) textureArrayWidth;
+                textureDimensions[1] = (GLfloat) textureArrayHeight;
+                atlas.Initialize(textureArrayWidth, textureArrayHeight, textureArrayLayers);
+                
+                // Configure Blending
+                glEnable(GL_BLEND);
+                glBlendFuncSeparate(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_ONE, GL_ZERO);
+
+                // Generate the vertex array object and configure it
+                glGenVertexArrays(1, &emptyVertexArrayObject);
+                glGenVertexArrays(1, &vertexArrayObject);
+                state.BindVertexArray(vertexArrayObject);
+
+                // Generate an element buffer object for the indices
+                // It's an static buffer so we can just load it now on initialization and forget about it (until the batch grows)
+                if (maxBatchQuads < defaultBatchQuads) maxBatchQuads = defaultBatchQuads;
+                batchCapacity = defaultBatchQuads;
+                glGenBuffers(1, &elementBufferObject);
+                indexType = UploadIndices(elementBufferObject, batchCapacity);
+                
+                // vertex buffer object
+                GLint majorVersion = 0;
+                GLint minorVersion = 0;
+                glGetIntegerv(GL_MAJOR_VERSION, &majorVersion);
+                glGetIntegerv(GL_MINOR_VERSION, &minorVersion);
+                bool bufferStorageSupported = (majorVersion > 4 || (majorVersion == 4 && minorVersion >= 4)) || HasExtension("GL_ARB_buffer_storage");
+                persistentStream = usePersistentStream && glBufferStorage && bufferStorageSupported;
+                Print(persistentStream ? "Renderer: Persistent mapped vertex stream.\n" : "Renderer: Orphaned vertex stream.\n");
+                glGenBuffers(1, &vertexBufferObject);
+                CreateVertexStream();
+
+                // Configure the vertex layer
+                SetVertexAttributes(0);
+                glEnableVertexAttribArray(0);
+                glEnableVertexAttribArray(1);
+                glEnableVertexAttribArray(2);
+                // Nothing gets unbound, the state cache takes care of not rebinding what is already bound
+            }
+
+            unsigned long StreamRegionBytes() {
+                return QuadSize() * batchCapacity;
+            }
+
+            // Bytes that a single quad takes in the stream
+            unsigned long QuadSize() {
+                switch (layout) {
+                    case CompactVertices: return sizeof(CompactVertex) * 4;
+                    case Instances:       return sizeof(Instance);
+                    default:              return sizeof(Vertex) * 4;
+                }
+            }
+
+            // Points the vertex attributes at the vertex data starting at byteOffset in the bound GL_ARRAY_BUFFER
+            void SetVertexAttributes(GLintptr byteOffset) {
+                SetVertexAttributes(byteOffset, layout);
+            }
+
+            void SetVertexAttributes(GLintptr byteOffset, vertexLayout attributesLayout) {
+                if (attributesLayout == Instances) {
+                    // position, size, texture rect (with the layer packed in) and color, once per instance
+                    GLsizei stride = sizeof(Instance);
+                    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, stride, (void*)(byteOffset));
+                    glVertexAttribPointer(1, 2, GL_UNSIGNED_SHORT, GL_FALSE, stride, (void*)(byteOffset + 2 * sizeof(float)));
+                    glVertexAttribPointer(2, 4, GL_UNSIGNED_SHORT, GL_FALSE, stride, (void*)(byteOffset + 2 * sizeof(float) + 2 * sizeof(short)));
+                    glVertexAttribPointer(3, 4, GL_UNSIGNED_BYTE, GL_TRUE, stride, (void*)(byteOffset + 2 * sizeof(float) + 6 * sizeof(short)));
+                    for (GLuint attribute = 0; attribute < 4; attribute++) {
+                        glVertexAttribDivisor(attribute, 1);
+                    }
+                    glEnableVertexAttribArray(3);
+                    return;
+                }
+                for (GLuint attribute = 0; attribute < 4; attribute++) {
+                    glVertexAttribDivisor(attribute, 0);
+                }
+                if (attributesLayout == CompactVertices) {
+                    GLsizei stride = sizeof(CompactVertex);
+                    glVertexAttribPointer(0, 2, GL_SHORT, GL_FALSE, stride, (void*)(byteOffset));
+                    glVertexAttribPointer(1, 2, GL_UNSIGNED_SHORT, GL_FALSE, stride, (void*)(byteOffset + 2 * sizeof(short)));
+                    glVertexAttribPointer(2, 4, GL_UNSIGNED_BYTE, GL_TRUE, stride, (void*)(byteOffset + 4 * sizeof(short)));
+                    // No layer in the vertex, the constant -1 tells vshader to unpack it from the texel coordinates
+                    glDisableVertexAttribArray(3);
+                    glVertexAttrib1f(3, -1.0f);
+                }
+                else {
+                    GLsizei stride = sizeof(Vertex);
+                    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, stride, (void*)(byteOffset));
+                    glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, stride, (void*)(byteOffset + 2 * sizeof(float)));
+                    glVertexAttribPointer(2, 4, GL_FLOAT, GL_FALSE, stride, (void*)(byteOffset + 4 * sizeof(float)));
+                    glVertexAttribPointer(3, 1, GL_FLOAT, GL_FALSE, stride, (void*)(byteOffset + 8 * sizeof(float)));
+                    glEnableVertexAttribArray(3);
+                }
+            }
+
+            // Allocates the storage of vertexBufferObject for the current batchCapacity, and maps it when using the persistent stream
+            void CreateVertexStream() {
+                state.BindArrayBuffer(vertexBufferObject);
+                if (persistentStream) {
+                    GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+                    GLsizeiptr streamBytes = StreamRegionBytes() * streamRegions;
+                    glBufferStorage(GL_ARRAY_BUFFER, streamBytes, NULL, flags);
+                    streamMapping = (unsigned char*) glMapBufferRange(GL_ARRAY_BUFFER, 0, streamBytes, flags);
+                    assert(streamMapping && "glMapBufferRange failed on the vertex stream");
+                    streamRegion = 0;
+                    vertexBuffer = streamMapping;
+                }
+                else {
+                    if (vertexStaging) {
+                        vertexStaging = (unsigned char*) HeapReAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, vertexStaging, StreamRegionBytes());
+                    }
+                    else {
+                        vertexStaging = (unsigned char*) HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, StreamRegionBytes());
+                    }
+                    glBufferData(GL_ARRAY_BUFFER, StreamRegionBytes(), NULL, GL_STREAM_DRAW);
+                    vertexBuffer = vertexStaging;
+                }
+                GetErrors(__FUNCTION__);
+            }
+
+            // The gl objects go away with the context, this gives back what the renderer keeps on the heap for the atlas
+            void Release() {
+                atlas.Release();
+            }
+
+            // Storage created with glBufferStorage is immutable, so to resize it the buffer object has to be replaced
+            void ReleasePersistentStream() {
+                state.BindArrayBuffer(vertexBufferObject);
+                glUnmapBuffer(GL_ARRAY_BUFFER);
+                state.BindArrayBuffer(0);
+                glDeleteBuffers(1, &vertexBufferObject);
+                glGenBuffers(1, &vertexBufferObject);
+                for (int i = 0; i < streamRegions; i++) {
+                    if (streamFences[i]) {
+                        glDeleteSync(streamFences[i]);
+                        streamFences[i] = 0;
+                    }
+                }
+                streamMapping = NULL;
+            }
+
+            // Blocks until the gpu is done reading the given region of the persistent stream
+            void WaitStreamRegion(int region) {
+                GLsync fence = streamFences[region];
+                if (!fence) {
+                    return;
+                }
+                GLenum result = glClientWaitSync(fence, 0, 0);
+                if (result == GL_TIMEOUT_EXPIRED) {
+                    stats.streamWaits++;
+                    do {
+                        // Make sure the fence actually gets to the gpu, then wait 1ms at a time
+                        result = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000);
+                    } while (result == GL_TIMEOUT_EXPIRED);
+                }
+                assert(result != GL_WAIT_FAILED && "glClientWaitSync failed on the vertex stream");
+                glDeleteSync(fence);
+                streamFences[region] = 0;
+            }
+
+            // Doubles the batch (up to maxBatchQuads) keeping the quads already in it
+            void GrowBatch() {
+                unsigned long newCapacity = batchCapacity * 2;
+                if (newCapacity > maxBatchQuads) newCapacity = maxBatchQuads;
+                if (persistentStream) {
+                    // The mapping can't be resized in place, so draw what is in it and start over on a bigger one
+                    Flush();
+                    ReleasePersistentStream();
+                }
+                batchCapacity = newCapacity;
+                CreateVertexStream();
+                state.BindVertexArray(vertexArrayObject);
+                indexType = UploadIndices(elementBufferObject, batchCapacity);
+            }
+
+            // Switches the format of the vertex stream. Whatever is in the batch gets drawn first
+            void SetVertexLayout(vertexLayout newLayout) {
+                if (newLayout == layout) {
+                    return;
+                }
+                Flush();
+                if (persistentStream) {
+                    ReleasePersistentStream();
+                }
+                layout = newLayout;
+                CreateVertexStream();
+                state.BindVertexArray(vertexArrayObject);
+                SetVertexAttributes(0);
+            }
+
+            // Sets the viewport and projection for this frame and clears the screen.
+            // Call it before adding quads if there can be more than a full batch of them, otherwise Render() does it for you
+            void BeginFrame(unsigned long clientWidth, unsigned long clientHeight, Color clearColor) {
+                glViewport(0, 0, clientWidth, clientHeight);
+                glClearColor(clearColor.r, clearColor.g, clearColor.b, clearColor.a);
+                glClear(GL_COLOR_BUFFER_BIT);
+
+                #define ToColumnMajor(v0,v1,v2,v3,v4,v5,v6,v7,v8,v9,v10,v11,v12,v13,v14,v15) v0,v4,v8,v12,v1,v5,v9,v13,v2,v6,v10,v14,v3,v7,v11,v15
+                GLfloat w = 2.0f/(float)clientWidth;
+                GLfloat h = 2.0f/(float)clientHeight;
+                GLfloat matrix[] = { ToColumnMajor(
+                    w,  0,  0, -1,
+                    0, -h,  0,  1,
+                    0,  0,  1,  0,
+                    0,  0,  0,  1
+                )};
+                #undef ToColumnMajor
+                for (int i = 0; i < 16; i++) {
+                    projectionMatrix[i] = matrix[i];
+                }
+                viewportSize[0] = (GLfloat) clientWidth;
+                viewportSize[1] = (GLfloat) clientHeight;
+                cullRect[0] = 0.0f;
+                cullRect[1] = 0.0f;
+                cullRect[2] = viewportSize[0];
+                cullRect[3] = viewportSize[1];
+                if (useCameraRect) {
+                    if (cameraRect[0] > cullRect[0]) cullRect[0] = cameraRect[0];
+                    if (cameraRect[1] > cullRect[1]) cullRect[1] = cameraRect[1];
+                    if (cameraRect[2] < cullRect[2]) cullRect[2] = cameraRect[2];
+                    if (cameraRect[3] < cullRect[3]) cullRect[3] = cameraRect[3];
+                }
+                frameBegun = true;
+            }
+
+            // Draws whatever is in the batch right now and empties it
+            void Flush() {
+                if (quadsToRender == 0) {
+                    return;
+                }
+                assert(frameBegun && "BeginFrame must be called before the batch is flushed");
+                GLuint texture = textureObject;
+                GLfloat* dimensions = textureDimensions;
+                if (currentTexture != 0) {
+                    texture = textureTable[currentTexture].object;
+                    dimensions = textureTable[currentTexture].dimensions;
+                }
+                state.BindVertexArray(vertexArrayObject);
+                state.BindTexture2DArray(texture);
+                state.BindArrayBuffer(vertexBufferObject);
+                if (persistentStream) {
+                    // The vertices are already there, just point at the region being used
+                    SetVertexAttributes(streamRegion * StreamRegionBytes());
+                }
+                else {
+                    // Orphan the old storage so the driver doesn't have to wait for the gpu to be done with it
+                    glBufferData(GL_ARRAY_BUFFER, StreamRegionBytes(), NULL, GL_STREAM_DRAW);
+                    glBufferSubData(GL_ARRAY_BUFFER, 0, QuadSize() * quadsToRender, vertexStaging);
+                }
+                GLuint program = (layout == Instances) ? instancedProgramObject : shaderProgramObject;
+                if (currentProgram != 0) {
+                    program = programTable[currentProgram];
+                }
+                assert(program && "No shader program loaded for the current vertex layout");
+                state.SetUniformMatrix4(program, "mvp", projectionMatrix);
+                state.SetUniform2(program, "texture_dimensions", dimensions);
+                if (layout == Instances) {
+                    // The 4 corners come out of gl_VertexID as a triangle strip
+                    glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, quadsToRender);
+                }
+                else {
+                    glDrawElements(GL_TRIANGLES, quadsToRender * 6, indexType, 0);
+                }
+                if (persistentStream) {
+                    streamFences[streamRegion] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+                    streamRegion = (streamRegion + 1) % streamRegions;
+                    WaitStreamRegion(streamRegion);
+                    vertexBuffer = streamMapping + streamRegion * StreamRegionBytes();
+                }
+                stats.flushes++;
+                stats.drawCalls++;
+                quadsToRender = 0;
+            }
+
+            // Returns the id of a new, empty, static layer
+            int CreateStaticLayer() {
+                assert(staticLayerCount < maxStaticLayers && "Too many static layers");
+                StaticLayer& layer = staticLayers[staticLayerCount];
+                glGenVertexArrays(1, &layer.vertexArray);
+                glGenBuffers(1, &layer.vertexBuffer);
+                glGenBuffers(1, &layer.elementBuffer);
+                layer.offset[0] = layer.offset[1] = 0.0f;
+                layer.scale[0] = layer.scale[1] = 1.0f;
+                layer.dirty = true;
+                return staticLayerCount++;
+            }
+
+            void ClearStaticLayer(int id) {
+                staticLayers[id].quadCount = 0;
+                staticLayers[id].dirty = true;
+            }
+
+            void AddStaticQuad(int id, Point2f position, Point2i size, Texture texture, Color color) {
+                StaticLayer& layer = staticLayers[id];
+                if (layer.quadCount == layer.quadCapacity) {
+                    layer.quadCapacity = layer.quadCapacity ? layer.quadCapacity * 2 : 1024;
+                    if (layer.quads) {
+                        layer.quads = (Instance*) HeapReAlloc(GetProcessHeap(), 0, layer.quads, sizeof(Instance) * layer.quadCapacity);
+                    }
+                    else {
+                        layer.quads = (Instance*) HeapAlloc(GetProcessHeap(), 0, sizeof(Instance) * layer.quadCapacity);
+                    }
+                }
+                layer.quads[layer.quadCount++] = MakeInstance(position, size, texture, color);
+                layer.dirty = true;
+            }
+
+            // Moves and scales the whole layer (offset in pixels, applied after the scale)
+            void SetStaticLayerTransform(int id, float offsetX, float offsetY, float scaleX, float scaleY) {
+                StaticLayer& layer = staticLayers[id];
+                layer.offset[0] = offsetX;
+                layer.offset[1] = offsetY;
+                layer.scale[0] = scaleX;
+                layer.scale[1] = scaleY;
+            }
+
+            // Builds the vertices of the layer and uploads them, with indices to match
+            void UploadStaticLayer(StaticLayer& layer) {
+                state.BindVertexArray(layer.vertexArray);
+                state.BindArrayBuffer(layer.vertexBuffer);
+                unsigned long vertexBytes = sizeof(Vertex) * 4 * layer.quadCount;
+                Vertex* vertices = (Vertex*) HeapAlloc(GetProcessHeap(), 0, vertexBytes ? vertexBytes : sizeof(Vertex));
+                for (unsigned long i = 0; i < layer.quadCount; i++) {
+                    Instance& instance = layer.quads[i];
+                    Texture texture(instance.U1(), instance.V1(), instance.U2(), instance.V2(), instance.Layer());
+                    Color color(instance.r / 255.0f, instance.g / 255.0f, instance.b / 255.0f, instance.a / 255.0f);
+                    Quad quad(Point2f(instance.x, instance.y), Point2i(instance.w, instance.h), texture, color);
+                    quad.MoveTexture(instance.SubTexelU(), instance.SubTexelV());
+                    vertices[i * 4 + 0] = quad.a;
+                    vertices[i * 4 + 1] = quad.b;
+                    vertices[i * 4 + 2] = quad.c;
+                    vertices[i * 4 + 3] = quad.d;
+                }
+                glBufferData(GL_ARRAY_BUFFER, vertexBytes, vertices, GL_STATIC_DRAW);
+                HeapFree(GetProcessHeap(), 0, vertices);
+                if (layer.quadCount > layer.uploadedCapacity || layer.uploadedCapacity == 0) {
+                    layer.uploadedCapacity = layer.quadCount > 0 ? layer.quadCount : 1;
+                    layer.indexType = UploadIndices(layer.elementBuffer, layer.uploadedCapacity);
+                    SetVertexAttributes(0, FloatVertices);
+                    glEnableVertexAttribArray(0);
+                    glEnableVertexAttribArray(1);
+                    glEnableVertexAttribArray(2);
+                }
+                layer.dirty = false;
+                stats.staticQuadsUploaded += layer.quadCount;
+            }
+
+            // Draws the layer right away (after whatever is in the batch, before the Submit()ted commands), uploading it first if it changed
+            void DrawStaticLayer(int id) {
+                StaticLayer& layer = staticLayers[id];
+                if (layer.dirty) {
+                    UploadStaticLayer(layer);
+                }
+                if (layer.quadCount == 0) {
+                    return;
+                }
+                assert(frameBegun && "BeginFrame must be called before drawing static layers");
+                Flush();
+                // mvp = projection * translation * scale
+                GLfloat transform[16] = {
+                    layer.scale[0], 0.0f, 0.0f, 0.0f,
+                    0.0f, layer.scale[1], 0.0f, 0.0f,
+                    0.0f, 0.0f, 1.0f, 0.0f,
+                    layer.offset[0], layer.offset[1], 0.0f, 1.0f
+                };
+                GLfloat mvp[16];
+                MultiplyMatrices(projectionMatrix, transform, mvp);
+                state.BindVertexArray(layer.vertexArray);
+                state.BindTexture2DArray(textureObject);
+                state.SetUniformMatrix4(shaderProgramObject, "mvp", mvp);
+                state.SetUniform2(shaderProgramObject, "texture_dimensions", textureDimensions);
+                glDrawElements(GL_TRIANGLES, layer.quadCount * 6, layer.indexType, 0);
+                stats.drawCalls++;
+                stats.staticQuads += layer.quadCount;
+            }
+
+            // Returns the id of a new tilemap of width x height cells, all empty. tileset is the rect (and layer) of the texture array
+            // holding the tiles, in rows of tileWidth x tileHeight
+            int CreateTilemap(int width, int height, Texture tileset, int tileWidth, int tileHeight) {
+                assert(tilemapCount < maxTilemaps && "Too many tilemaps");
+                Tilemap& tilemap = tilemaps[tilemapCount];
+                tilemap.width = width;
+                tilemap.height = height;
+                tilemap.tileset = tileset;
+                tilemap.tileWidth = tileWidth;
+                tilemap.tileHeight = tileHeight;
+                tilemap.offset[0] = tilemap.offset[1] = 0.0f;
+                tilemap.scale = 1.0f;
+                glGenTextures(1, &tilemap.indexTexture);
+                state.BindTextureForEdit(1, GL_TEXTURE_2D, tilemap.indexTexture);
+                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+                unsigned short* empty = (unsigned short*) HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(unsigned short) * width * height);
+                glPixelStorei(GL_UNPACK_ALIGNMENT, 2);
+                glTexImage2D(GL_TEXTURE_2D, 0, GL_R16UI, width, height, 0, GL_RED_INTEGER, GL_UNSIGNED_SHORT, empty);
+                glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+                HeapFree(GetProcessHeap(), 0, empty);
+                GetErrors(__FUNCTION__);
+                return tilemapCount++;
+            }
+
+            // Overwrites a w x h rect of cells starting at cell (x, y). cells is w * h values, row by row
+            void SetTiles(int id, int x, int y, int w, int h, const unsigned short* cells) {
+                Tilemap& tilemap = tilemaps[id];
+                assert(x >= 0 && y >= 0 && x + w <= tilemap.width && y + h <= tilemap.height && "SetTiles out of the map");
+                state.BindTextureForEdit(1, GL_TEXTURE_2D, tilemap.indexTexture);
+                glPixelStorei(GL_UNPACK_ALIGNMENT, 2);
+                glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, w, h, GL_RED_INTEGER, GL_UNSIGNED_SHORT, cells);
+                glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+            }
+
+            // Where the top left corner of the map goes on screen, and how many screen pixels per tileset texel
+            void SetTilemapTransform(int id, float offsetX, float offsetY, float scale) {
+                tilemaps[id].offset[0] = offsetX;
+                tilemaps[id].offset[1] = offsetY;
+                tilemaps[id].scale = scale;
+            }
+
+            // Draws the whole map right away (after whatever is in the batch, before the Submit()ted commands)
+            void DrawTilemap(int id) {
+                assert(frameBegun && "BeginFrame must be called before drawing tilemaps");
+                assert(tilemapProgramObject && "LoadTilemapShaders must be called before drawing tilemaps");
+                Flush();
+                Tilemap& tilemap = tilemaps[id];
+                GLuint program = tilemapProgramObject;
+                GLfloat mapSize[2] = { (GLfloat) tilemap.width, (GLfloat) tilemap.height };
+                GLfloat tileSize[2] = { (GLfloat) tilemap.tileWidth, (GLfloat) tilemap.tileHeight };
+                GLfloat tilesetOrigin[2] = { (GLfloat) tilemap.tileset.u1, (GLfloat) tilemap.tileset.v1 };
+                state.BindVertexArray(emptyVertexArrayObject);
+                state.BindTexture2DArray(textureObject);
+                state.BindTexture(1, GL_TEXTURE_2D, tilemap.indexTexture);
+                state.SetUniform1i(program, "texture_sampler", 0);
+                state.SetUniform1i(program, "tile_indices", 1);
+                state.SetUniform2(program, "viewport_size", viewportSize);
+                state.SetUniform2(program, "map_offset", tilemap.offset);
+                state.SetUniform1(program, "map_scale", tilemap.scale);
+                state.SetUniform2(program, "map_size", mapSize);
+                state.SetUniform2(program, "tile_size", tileSize);
+                state.SetUniform2(program, "tileset_origin", tilesetOrigin);
+                state.SetUniform1(program, "tileset_columns", (GLfloat) ((tilemap.tileset.u2 - tilemap.tileset.u1) / tilemap.tileWidth));
+                state.SetUniform1(program, "tileset_layer", (GLfloat) tilemap.tileset.layer);
+                glDrawArrays(GL_TRIANGLES, 0, 3);
+                stats.drawCalls++;
+            }
+
+            // out = a * b, all of them 4x4 column major
+            static void MultiplyMatrices(const GLfloat* a, const GLfloat* b, GLfloat* out) {
+                for (int column = 0; column < 4; column++) {
+                    for (int row = 0; row < 4; row++) {
+                        GLfloat value = 0.0f;
+                        for (int k = 0; k < 4; k++) {
+                            value += a[k * 4 + row] * b[column * 4 + k];
+                        }
+                        out[column * 4 + row] = value;
+                    }
+                }
+            }
+
+            // Queues a quad to be drawn sorted by key at Render
+            void Submit(unsigned long long key, Point2f position, Point2i size, Texture texture, Color color) {
+                if (commandCount == commandCapacity) {
+                    GrowCommandQueue();
+                }
+                commandInstances[commandCount] = MakeInstance(position, size, texture, color);
+                commands[commandCount].key = key;
+                commands[commandCount].instance = commandCount;
+                commandCount++;
+            }
+
+            void GrowCommandQueue() {
+                unsigned long newCapacity = commandCapacity ? commandCapacity * 2 : 4096;
+                HANDLE heap = GetProcessHeap();
+                if (commands) {
+                    commands = (DrawCommand*) HeapReAlloc(heap, 0, commands, sizeof(DrawCommand) * newCapacity);
+                    commandsScratch = (DrawCommand*) HeapReAlloc(heap, 0, commandsScratch, sizeof(DrawCommand) * newCapacity);
+                    commandInstances = (Instance*) HeapReAlloc(heap, 0, commandInstances, sizeof(Instance) * newCapacity);
+                }
+                else {
+                    commands = (DrawCommand*) HeapAlloc(heap, 0, sizeof(DrawCommand) * newCapacity);
+                    commandsScratch = (DrawCommand*) HeapAlloc(heap, 0, sizeof(DrawCommand) * newCapacity);
+                    commandInstances = (Instance*) HeapAlloc(heap, 0, sizeof(Instance) * newCapacity);
+                }
+                commandCapacity = newCapacity;
+            }
+
+            // LSD radix sort of the commands by key, 8 bits per pass. Passes where every key has the same byte are skipped,
+            // which is most of them in practice (few layers, programs and textures). Stable, so submission order breaks ties.
+            // Returns the array holding the sorted result (commands or commandsScratch)
+            DrawCommand* SortCommands() {
+                DrawCommand* source = commands;
+                DrawCommand* destination = commandsScratch;
+                for (int pass = 0; pass < 8; pass++) {
+                    int shift = pass * 8;
+                    unsigned long histogram[256] = {};
+                    for (unsigned long i = 0; i < commandCount; i++) {
+                        histogram[(source[i].key >> shift) & 0xFF]++;
+                    }
+                    if (histogram[(source[0].key >> shift) & 0xFF] == commandCount) {
+                        continue;
+                    }
+                    unsigned long offset = 0;
+                    for (int bucket = 0; bucket < 256; bucket++) {
+                        unsigned long count = histogram[bucket];
+                        histogram[bucket] = offset;
+                        offset += count;
+                    }
+                    for (unsigned long i = 0; i < commandCount; i++) {
+                        destination[histogram[(source[i].key >> shift) & 0xFF]++] = source[i];
+                    }
+                    DrawCommand* swap = source;
+                    source = destination;
+                    destination = swap;
+                }
+                return source;
+            }
+
+            // Draws the queued commands in key order. Whatever is in the batch already is drawn first
+            void FlushCommands() {
+                if (commandCount == 0) {
+                    return;
+                }
+                PROFILE_ZONE("Flush commands");
+                Flush();
+                // Culled before sorting so they aren't sorted either. Until the sort commands[i].instance is still i
+                if (cullQuads && frameBegun) {
+                    unsigned long visibleCount = 0;
+                    for (unsigned long i = 0; i < commandCount; i += 8) {
+                        int count = commandCount - i < 8 ? (int) (commandCount - i) : 8;
+                        unsigned int mask = VisibleMask(commandInstances + i, count);
+                        for (int j = 0; j < count; j++) {
+                            if (mask & (1 << j)) commands[visibleCount++] = commands[i + j];
+                        }
+                    }
+                    stats.culled += commandCount - visibleCount;
+                    commandCount = visibleCount;
+                    if (commandCount == 0) {
+                        return;
+                    }
+                }
+                DrawCommand* sorted = SortCommands();
+                for (unsigned long i = 0; i < commandCount; i++) {
+                    unsigned char program = SortKeyProgram(sorted[i].key);
+                    unsigned short texture = SortKeyTexture(sorted[i].key);
+                    if (program != currentProgram || texture != currentTexture) {
+                        Flush();
+                        if (program != currentProgram) stats.stateChanges++;
+                        if (texture != currentTexture) stats.stateChanges++;
+                        currentProgram = program;
+                        currentTexture = texture;
+                    }
+                    AddInstance(commandInstances[sorted[i].instance]);
+                }
+                Flush();
+                stats.commands += commandCount;
+                commandCount = 0;
+                currentProgram = 0;
+                currentTexture = 0;
+            }
+
+            void Render(unsigned long clientWidth, unsigned long clientHeight, Color clearColor, HDC deviceContextHandle) {
+                if (!frameBegun) {
+                    BeginFrame(clientWidth, clientHeight, clearColor);
+                }
+                Flush();
+                FlushRecordings();
+                FlushCommands();
+
+                Win32::SwapPixelBuffers(deviceContextHandle);
+                stats.glCallsIssued = state.callsIssued;
+                stats.glCallsSaved = state.callsSaved;
+                state.callsIssued = 0;
+                state.callsSaved = 0;
+                lastFrameStats = stats;
+                stats = FrameStats();
+                frameBegun = false;
+            }
+        
+            // Restricts culling to a rect of the screen (on top of the viewport) from the next BeginFrame on
+            void SetCameraRect(Point2f position, Point2f size) {
+                useCameraRect = true;
+                cameraRect[0] = position.x;
+                cameraRect[1] = position.y;
+                cameraRect[2] = position.x + size.x;
+                cameraRect[3] = position.y + size.y;
+            }
+
+            void ClearCameraRect() {
+                useCameraRect = false;
+            }
+
+            bool Visible(float x, float y, float w, float h) {
+                if (!cullQuads || !frameBegun) return true;
+                return x < cullRect[2] && x + w > cullRect[0] && y < cullRect[3] && y + h > cullRect[1];
+            }
+
+            // Bit i is set if instances[i] overlaps the cull rect, for up to 8 instances
+            unsigned int VisibleMask(const Instance* instances, int count) {
+                if (!cullQuads || !frameBegun) return (1u << count) - 1;
+                int i = 0;
+                unsigned int mask = 0;
+                #if defined(__AVX2__)
+                if (count == 8) {
+                    // x, y and w|h are dwords 0, 1 and 2 of each 6 dword instance
+                    __m256i index = _mm256_setr_epi32(0, 6, 12, 18, 24, 30, 36, 42);
+                    __m256 x = _mm256_i32gather_ps((const float*) instances, index, 4);
+                    __m256 y = _mm256_i32gather_ps((const float*) instances + 1, index, 4);
+                    __m256i wh = _mm256_i32gather_epi32((const int*) instances + 2, index, 4);
+                    __m256 w = _mm256_cvtepi32_ps(_mm256_and_si256(wh, _mm256_set1_epi32(0xFFFF)));
+                    __m256 h = _mm256_cvtepi32_ps(_mm256_srli_epi32(wh, 16));
+                    __m256 visible = _mm256_and_ps(
+                        _mm256_and_ps(_mm256_cmp_ps(x, _mm256_set1_ps(cullRect[2]), _CMP_LT_OQ), _mm256_cmp_ps(_mm256_add_ps(x, w), _mm256_set1_ps(cullRect[0]), _CMP_GT_OQ)),
+                        _mm256_and_ps(_mm256_cmp_ps(y, _mm256_set1_ps(cullRect[3]), _CMP_LT_OQ), _mm256_cmp_ps(_mm256_add_ps(y, h), _mm256_set1_ps(cullRect[1]), _CMP_GT_OQ)));
+                    return (unsigned int) _mm256_movemask_ps(visible);
+                }
+                #endif
+                #if defined(_M_X64) || defined(__SSE2__)
+                __m128 left = _mm_set1_ps(cullRect[0]);
+                __m128 top = _mm_set1_ps(cullRect[1]);
+                __m128 right = _mm_set1_ps(cullRect[2]);
+                __m128 bottom = _mm_set1_ps(cullRect[3]);
+                for (; i + 4 <= count; i += 4) {
+                    // The first 16 bytes of 4 instances transposed into x, y, w|h and u1|v1 (unused)
+                    __m128 x = _mm_loadu_ps((const float*) (instances + i));
+                    __m128 y = _mm_loadu_ps((const float*) (instances + i + 1));
+                    __m128 wh = _mm_loadu_ps((const float*) (instances + i + 2));
+                    __m128 uv = _mm_loadu_ps((const float*) (instances + i + 3));
+                    _MM_TRANSPOSE4_PS(x, y, wh, uv);
+                    __m128 w = _mm_cvtepi32_ps(_mm_and_si128(_mm_castps_si128(wh), _mm_set1_epi32(0xFFFF)));
+                    __m128 h = _mm_cvtepi32_ps(_mm_srli_epi32(_mm_castps_si128(wh), 16));
+                    __m128 visible = _mm_and_ps(
+                        _mm_and_ps(_mm_cmplt_ps(x, right), _mm_cmpgt_ps(_mm_add_ps(x, w), left)),
+                        _mm_and_ps(_mm_cmplt_ps(y, bottom), _mm_cmpgt_ps(_mm_add_ps(y, h), top)));
+                    mask |= (unsigned int) _mm_movemask_ps(visible) << i;
+                }
+                #endif
+                for (; i < count; i++) {
+                    if (Visible(instances[i].x, instances[i].y, instances[i].w, instances[i].h)) mask |= 1u << i;
+                }
+                return mask;
+            }
+
+            // Makes room in the batch for one more quad
+            void ReserveQuad() {
+                if (quadsToRender == batchCapacity) {
+                    if (growBatch && batchCapacity < maxBatchQuads) {
+                        GrowBatch();
+                    }
+                    else {
+                        Flush();
+                    }
+                }
+            }
+
+            // With the Instances layout the quad is expected to be axis aligned, as the ones made by Quad(position, size, texture, color),
+            // since only its top left (d) and bottom right (b) corners are kept. The color is taken from d.
+            void AddQuad(Quad quad) {
+                if (cullQuads && frameBegun) {
+                    float left = quad.a.x, right = quad.a.x, top = quad.a.y, bottom = quad.a.y;
+                    Vertex* corners[] = { &quad.b, &quad.c, &quad.d };
+                    for (int i = 0; i < 3; i++) {
+                        if (corners[i]->x < left) left = corners[i]->x;
+                        if (corners[i]->x > right) right = corners[i]->x;
+                        if (corners[i]->y < top) top = corners[i]->y;
+                        if (corners[i]->y > bottom) bottom = corners[i]->y;
+                    }
+                    if (!Visible(left, top, right - left, bottom - top)) {
+                        stats.culled++;
+                        return;
+                    }
+                }
+                ReserveQuad();
+                if (layout == Instances) {
+                    Instance* instance = ((Instance*) vertexBuffer) + quadsToRender;
+                    instance->x = quad.d.x;
+                    instance->y = quad.d.y;
+                    instance->w = (unsigned short) (quad.b.x - quad.d.x);
+                    instance->h = (unsigned short) (quad.b.y - quad.d.y);
+                    instance->SetTexture(quad.d.u, quad.d.v, quad.b.u, quad.b.v, (int) quad.d.layer);
+                    instance->r = Color::ToByte(quad.d.r);
+                    instance->g = Color::ToByte(quad.d.g);
+                    instance->b = Color::ToByte(quad.d.b);
+                    instance->a = Color::ToByte(quad.d.a);
+                }
+                else if (layout == CompactVertices) {
+                    CompactVertex* vertices = ((CompactVertex*) vertexBuffer) + quadsToRender * 4;
+                    vertices[0] = CompactVertex(quad.a);
+                    vertices[1] = CompactVertex(quad.b);
+                    vertices[2] = CompactVertex(quad.c);
+                    vertices[3] = CompactVertex(quad.d);
+                }
+                else {
+                    Vertex* vertices = ((Vertex*) vertexBuffer) + quadsToRender * 4;
+                    vertices[0] = quad.a;
+                    vertices[1] = quad.b;
+                    vertices[2] = quad.c;
+                    vertices[3] = quad.d;
+                }
+                quadsToRender++;
+                stats.quads++;
+            }
+
+            static Instance MakeInstance(Point2f position, Point2i size, Texture texture, Color color) {
+                Instance instance;
+                instance.x = position.x;
+                instance.y = position.y;
+                instance.w = (unsigned short) size.x;
+                instance.h = (unsigned short) size.y;
+                instance.SetTexture(texture.u1, texture.v1, texture.u2, texture.v2, texture.layer);
+                instance.r = Color::ToByte(color.r);
+                instance.g = Color::ToByte(color.g);
+                instance.b = Color::ToByte(color.b);
+                instance.a = Color::ToByte(color.a);
+                return instance;
+            }
+
+            // Adds an already built instance to the batch, expanding it to 4 vertices if the layout isn't Instances
+            void AddInstance(const Instance& instance) {
+                if (layout != Instances) {
+                    Texture texture(instance.U1(), instance.V1(), instance.U2(), instance.V2(), instance.Layer());
+                    Color color(instance.r / 255.0f, instance.g / 255.0f, instance.b / 255.0f, instance.a / 255.0f);
+                    Quad quad(Point2f(instance.x, instance.y), Point2i(instance.w, instance.h), texture, color);
+                    quad.MoveTexture(instance.SubTexelU(), instance.SubTexelV());
+                    AddQuad(quad);
+                    return;
+                }
+                if (!Visible(instance.x, instance.y, instance.w, instance.h)) {
+                    stats.culled++;
+                    return;
+                }
+                ReserveQuad();
+                ((Instance*) vertexBuffer)[quadsToRender] = instance;
+                quadsToRender++;
+                stats.quads++;
+            }
+
+            // Same as AddQuad(Quad(position, size, texture, color)) but with the Instances layout it writes the instance directly,
+            // without building the 4 vertices first
+            void AddSprite(Point2f position, Point2i size, Texture texture, Color color) {
+                AddInstance(MakeInstance(position, size, texture, color));
+            }
+
+            // Writes quads [first, first + count) of span as instances to out, skipping the ones outside of cullRect (left, top, right,
+            // bottom; null to keep all of them). Returns how many were written. This is the reference for WriteInstancesAvx2
+            static unsigned long WriteInstancesScalar(Instance* out, const QuadSpan& span, unsigned long first, unsigned long count, const GLfloat* cullRect) {
+                unsigned long written = 0;
+                for (unsigned long i = first; i < first + count; i++) {
+                    if (cullRect && !(span.x[i] < cullRect[2] && span.x[i] + span.w[i] > cullRect[0] && span.y[i] < cullRect[3] && span.y[i] + span.h[i] > cullRect[1])) {
+                        continue;
+                    }
+                    const Texture& rect = span.rects[span.rect[i]];
+                    Instance& instance = out[written++];
+                    instance.x = span.x[i];
+                    instance.y = span.y[i];
+                    instance.w = (unsigned short) (int) span.w[i];
+                    instance.h = (unsigned short) (int) span.h[i];
+                    instance.SetTexture(rect.u1, rect.v1, rect.u2, rect.v2, rect.layer);
+                    CopyMemory(&instance.r, &span.color[i], 4);
+                }
+                return written;
+            }
+
+            #if defined(__AVX2__)
+            // Same as WriteInstancesScalar, 8 quads at a time: the 6 dwords of 8 instances are built as 6 registers, one per field,
+            // transposed into one register per instance and only the visible ones are stored
+            static unsigned long WriteInstancesAvx2(Instance* out, const QuadSpan& span, unsigned long first, unsigned long count, const GLfloat* cullRect) {
+                static const GLfloat noCulling[4] = { -3.0e38f, -3.0e38f, 3.0e38f, 3.0e38f };
+                const GLfloat* rect = cullRect ? cullRect : noCulling;
+                __m256 left = _mm256_set1_ps(rect[0]);
+                __m256 top = _mm256_set1_ps(rect[1]);
+                __m256 right = _mm256_set1_ps(rect[2]);
+                __m256 bottom = _mm256_set1_ps(rect[3]);
+                __m256i lowHalf = _mm256_set1_epi32(0xFFFF);
+                // Textures are 5 ints: u1, v1, u2, v2, layer
+                const int* rects = (const int*) span.rects;
+                static_assert(sizeof(Texture) == 5 * sizeof(int), "Texture is expected to be u1, v1, u2, v2, layer");
+                // Instances are 6 dwords, the last 2 lanes of each row are never stored
+                __m256i sixDwords = _mm256_setr_epi32(-1, -1, -1, -1, -1, -1, 0, 0);
+                unsigned long written = 0;
+                unsigned long i = first;
+                for (; i + 8 <= first + count; i += 8) {
+                    __m256 x = _mm256_loadu_ps(span.x + i);
+                    __m256 y = _mm256_loadu_ps(span.y + i);
+                    __m256 w = _mm256_loadu_ps(span.w + i);
+                    __m256 h = _mm256_loadu_ps(span.h + i);
+                    __m256 visible = _mm256_and_ps(
+                        _mm256_and_ps(_mm256_cmp_ps(x, right, _CMP_LT_OQ), _mm256_cmp_ps(_mm256_add_ps(x, w), left, _CMP_GT_OQ)),
+                        _mm256_and_ps(_mm256_cmp_ps(y, bottom, _CMP_LT_OQ), _mm256_cmp_ps(_mm256_add_ps(y, h), top, _CMP_GT_OQ)));
+                    unsigned int mask = (unsigned int) _mm256_movemask_ps(visible);
+                    if (mask == 0) {
+                        continue;
+                    }
+                    __m256i rectIndex = _mm256_mullo_epi32(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*) (span.rect + i))), _mm256_set1_epi32(5));
+                    __m256i u1 = _mm256_i32gather_epi32(rects, rectIndex, 4);
+                    __m256i v1 = _mm256_i32gather_epi32(rects + 1, rectIndex, 4);
+                    __m256i u2 = _mm256_i32gather_epi32(rects + 2, rectIndex, 4);
+                    __m256i v2 = _mm256_i32gather_epi32(rects + 3, rectIndex, 4);
+                    __m256i layer = _mm256_i32gather_epi32(rects + 4, rectIndex, 4);
+                    __m256i wh = _mm256_or_si256(_mm256_and_si256(_mm256_cvttps_epi32(w), lowHalf), _mm256_slli_epi32(_mm256_cvttps_epi32(h), 16));
+                    // Same as PackU and PackV: 13 bits of texel and 3 of layer in each half
+                    __m256i texelBits = _mm256_set1_epi32(maxPackedTexel);
+                    __m256i layerBits = _mm256_set1_epi32(7);
+                    __m256i packedU1 = _mm256_or_si256(_mm256_and_si256(u1, texelBits), _mm256_slli_epi32(_mm256_and_si256(layer, layerBits), 13));
+                    __m256i packedV1 = _mm256_or_si256(_mm256_and_si256(v1, texelBits), _mm256_slli_epi32(_mm256_and_si256(_mm256_srli_epi32(layer, 3), layerBits), 13));
+                    __m256i uv1 = _mm256_or_si256(packedU1, _mm256_slli_epi32(packedV1, 16));
+                    __m256i uv2 = _mm256_or_si256(_mm256_and_si256(u2, texelBits), _mm256_slli_epi32(_mm256_and_si256(v2, texelBits), 16));
+                    __m256i rgba = _mm256_loadu_si256((const __m256i*) (span.color + i));
+                    // 8x8 dword transpose, rows are x, y, wh, uv1, uv2, rgba and 2 unused ones
+                    __m256i r0 = _mm256_castps_si256(x), r1 = _mm256_castps_si256(y), r2 = wh, r3 = uv1, r4 = uv2, r5 = rgba, r6 = rgba, r7 = rgba;
+                    __m256i t0 = _mm256_unpacklo_epi32(r0, r1), t1 = _mm256_unpackhi_epi32(r0, r1);
+                    __m256i t2 = _mm256_unpacklo_epi32(r2, r3), t3 = _mm256_unpackhi_epi32(r2, r3);
+                    __m256i t4 = _mm256_unpacklo_epi32(r4, r5), t5 = _mm256_unpackhi_epi32(r4, r5);
+                    __m256i t6 = _mm256_unpacklo_epi32(r6, r7), t7 = _mm256_unpackhi_epi32(r6, r7);
+                    __m256i s0 = _mm256_unpacklo_epi64(t0, t2), s1 = _mm256_unpackhi_epi64(t0, t2);
+                    __m256i s2 = _mm256_unpacklo_epi64(t1, t3), s3 = _mm256_unpackhi_epi64(t1, t3);
+                    __m256i s4 = _mm256_unpacklo_epi64(t4, t6), s5 = _mm256_unpackhi_epi64(t4, t6);
+                    __m256i s6 = _mm256_unpacklo_epi64(t5, t7), s7 = _mm256_unpackhi_epi64(t5, t7);
+                    __m256i instances[8] = {
+                        _mm256_permute2x128_si256(s0, s4, 0x20), _mm256_permute2x128_si256(s1, s5, 0x20),
+                        _mm256_permute2x128_si256(s2, s6, 0x20), _mm256_permute2x128_si256(s3, s7, 0x20),
+                        _mm256_permute2x128_si256(s0, s4, 0x31), _mm256_permute2x128_si256(s1, s5, 0x31),
+                        _mm256_permute2x128_si256(s2, s6, 0x31), _mm256_permute2x128_si256(s3, s7, 0x31)
+                    };
+                    for (int j = 0; j < 8; j++) {
+                        if (mask & (1 << j)) {
+                            _mm256_maskstore_epi32((int*) (out + written), sixDwords, instances[j]);
+                            written++;
+                        }
+                    }
+                }
+                return written + WriteInstancesScalar(out + written, span, i, first + count - i, cullRect);
+            }
+            #endif
+
+            static unsigned long WriteInstances(Instance* out, const QuadSpan& span, unsigned long first, unsigned long count, const GLfloat* cullRect) {
+                #if defined(__AVX2__)
+                return WriteInstancesAvx2(out, span, first, count, cullRect);
+                #else
+                return WriteInstancesScalar(out, span, first, count, cullRect);
+                #endif
+            }
+
+            // Adds all the quads of span. With the Instances layout they are written straight into the vertex stream, otherwise they
+            // go one by one through AddInstance
+            void AddQuads(const QuadSpan& span) {
+                const GLfloat* cull = (cullQuads && frameBegun) ? cullRect : 0;
+                if (layout != Instances) {
+                    for (unsigned long i = 0; i < span.count; i++) {
+                        Instance instance;
+                        if (WriteInstancesScalar(&instance, span, i, 1, 0)) {
+                            AddInstance(instance);
+                        }
+                    }
+                    return;
+                }
+                unsigned long added = 0;
+                while (added < span.count) {
+                    ReserveQuad();
+                    unsigned long count = batchCapacity - quadsToRender;
+                    if (count > span.count - added) count = span.count - added;
+                    unsigned long written = WriteInstances(((Instance*) vertexBuffer) + quadsToRender, span, added, count, cull);
+                    stats.culled += count - written;
+                    quadsToRender += written;
+                    stats.quads += written;
+                    added += count;
+                }
+            }
+
+            // Returns the recording context index, empty, to be filled by one thread until Render. Call it from the gl thread,
+            // after BeginFrame if the recorded quads should be culled
+            RecordingContext* GetRecordingContext(int index) {
+                assert(index < maxRecordingContexts && "Too many recording contexts");
+                RecordingContext* context = &recordings[index];
+                context->count = 0;
+                context->culled = 0;
+                context->cull = cullQuads && frameBegun;
+                CopyMemory(context->cullRect, cullRect, sizeof(cullRect));
+                if (index >= recordingCount) recordingCount = index + 1;
+                return context;
+            }
+
+            // Sets where each context starts in the stitched stream and returns the total
+            static unsigned long PrefixSumRecordings(RecordingContext* contexts, int contextCount) {
+                unsigned long total = 0;
+                for (int i = 0; i < contextCount; i++) {
+                    contexts[i].first = total;
+                    total += contexts[i].count;
+                }
+                return total;
+            }
+
+            struct CopyRecordingsJob {
+                Instance* out;
+                RecordingContext* contexts;
+                unsigned long first;
+                unsigned long count;
+            };
+
+            // Task i copies the part of context i that falls in [first, first + count) of the stitched stream
+            static void CopyRecordingTask(void* data, int task) {
+                CopyRecordingsJob* job = (CopyRecordingsJob*) data;
+                RecordingContext& context = job->contexts[task];
+                unsigned long begin = context.first > job->first ? context.first : job->first;
+                unsigned long end = context.first + context.count;
+                if (end > job->first + job->count) end = job->first + job->count;
+                if (begin < end) {
+                    CopyMemory(job->out + (begin - job->first), context.instances + (begin - context.first), sizeof(Instance) * (end - begin));
+                }
+            }
+
+            // Copies [first, first + count) of the stitched stream (after PrefixSumRecordings) to out, one task per context
+            static void CopyRecordings(Instance* out, RecordingContext* contexts, int contextCount, unsigned long first, unsigned long count, ThreadPool* pool) {
+                CopyRecordingsJob job = { out, contexts, first, count };
+                if (pool) {
+                    pool->Run(CopyRecordingTask, &job, contextCount);
+                }
+                else {
+                    for (int i = 0; i < contextCount; i++) {
+                        CopyRecordingTask(&job, i);
+                    }
+                }
+            }
+
+            // Moves everything in the recording contexts to the batch, in context order
+            void FlushRecordings() {
+                unsigned long total = PrefixSumRecordings(recordings, recordingCount);
+                for (int i = 0; i < recordingCount; i++) {
+                    stats.culled += recordings[i].culled;
+                    recordings[i].culled = 0;
+                }
+                stats.recorded += total;
+                if (layout != Instances) {
+                    for (int i = 0; i < recordingCount; i++) {
+                        for (unsigned long j = 0; j < recordings[i].count; j++) {
+                            AddInstance(recordings[i].instances[j]);
+                        }
+                        recordings[i].count = 0;
+                    }
+                    return;
+                }
+                // Grow once up front instead of doubling on the way
+                while (growBatch && batchCapacity < maxBatchQuads && quadsToRender + total > batchCapacity) {
+                    GrowBatch();
+                }
+                unsigned long copied = 0;
+                while (copied < total) {
+                    ReserveQuad();
+                    unsigned long count = batchCapacity - quadsToRender;
+                    if (count > total - copied) count = total - copied;
+                    CopyRecordings(((Instance*) vertexBuffer) + quadsToRender, recordings, recordingCount, copied, count, pool);
+                    quadsToRender += count;
+                    stats.quads += count;
+                    copied += count;
+                }
+                for (int i = 0; i < recordingCount; i++) {
+                    recordings[i].count = 0;
+                }
+            }
+
+            // out[i] = in[i] moved by (x, y) and with its color replaced by rgba (r in the lowest byte)
+            static void OffsetInstances(Instance* out, const Instance* in, int count, float x, float y, unsigned int rgba) {
+                int i = 0;
+                #if defined(_M_X64) || defined(__SSE2__)
+                // 4 instances are 6 registers of 4 dwords. Dword j of the group is dword j % 6 of an instance:
+                // 0 x, 1 y, 2 w|h, 3 u1|v1, 4 u2|v2, 5 rgba
+                __m128 offsets[6];
+                __m128 offsetMasks[6];
+                __m128i colors[6];
+                __m128i colorMasks[6];
+                for (int k = 0; k < 6; k++) {
+                    float offset[4];
+                    int offsetMask[4];
+                    int color[4];
+                    int colorMask[4];
+                    for (int lane = 0; lane < 4; lane++) {
+                        int field = (k * 4 + lane) % 6;
+                        offset[lane] = field == 0 ? x : (field == 1 ? y : 0.0f);
+                        offsetMask[lane] = field <= 1 ? -1 : 0;
+                        color[lane] = field == 5 ? (int) rgba : 0;
+                        colorMask[lane] = field == 5 ? -1 : 0;
+                    }
+                    offsets[k] = _mm_loadu_ps(offset);
+                    offsetMasks[k] = _mm_castsi128_ps(_mm_loadu_si128((const __m128i*) offsetMask));
+                    colors[k] = _mm_loadu_si128((const __m128i*) color);
+                    colorMasks[k] = _mm_loadu_si128((const __m128i*) colorMask);
+                }
+                for (; i + 4 <= count; i += 4) {
+                    const __m128i* source = (const __m128i*) (in + i);
+                    __m128i* destination = (__m128i*) (out + i);
+                    for (int k = 0; k < 6; k++) {
+                        __m128i value = _mm_loadu_si128(source + k);
+                        // Only the x and y lanes take the add, the others keep their bits as they are
+                        __m128 moved = _mm_add_ps(_mm_castsi128_ps(value), offsets[k]);
+                        value = _mm_castps_si128(_mm_or_ps(_mm_and_ps(offsetMasks[k], moved), _mm_andnot_ps(offsetMasks[k], _mm_castsi128_ps(value))));
+                        value = _mm_or_si128(_mm_andnot_si128(colorMasks[k], value), colors[k]);
+                        _mm_storeu_si128(destination + k, value);
+                    }
+                }
+                #endif
+                for (; i < count; i++) {
+                    out[i] = in[i];
+                    out[i].x += x;
+                    out[i].y += y;
+                    CopyMemory(&out[i].r, &rgba, 4);
+                }
+            }
+
+            // Draws text with its top left corner at position, each glyph scaled up scale times. Strings that were drawn recently with
+            // the same font and scale are taken from the text cache, so static HUD text costs a copy of its glyphs
+            void AddText(Point2f position, const char* text, const Font& font, int scale, Color color) {
+                unsigned long layoutsBefore = textCache.layouts;
+                TextCache::TextRun* run = textCache.Get(text, font, scale);
+                stats.textLayouts += textCache.layouts - layoutsBefore;
+                Instance colored;
+                colored.r = Color::ToByte(color.r);
+                colored.g = Color::ToByte(color.g);
+                colored.b = Color::ToByte(color.b);
+                colored.a = Color::ToByte(color.a);
+                unsigned int rgba;
+                CopyMemory(&rgba, &colored.r, 4);
+                stats.glyphs += run->glyphCount;
+                if (layout != Instances) {
+                    for (int i = 0; i < run->glyphCount; i++) {
+                        OffsetInstances(&colored, &run->glyphs[i], 1, position.x, position.y, rgba);
+                        AddInstance(colored);
+                    }
+                    return;
+                }
+                // Moved and culled 8 at a time in a block on the stack, the stream is mapped write only so it's never read back
+                Instance block[8];
+                for (int i = 0; i < run->glyphCount; i += 8) {
+                    int blockCount = run->glyphCount - i < 8 ? run->glyphCount - i : 8;
+                    OffsetInstances(block, run->glyphs + i, blockCount, position.x, position.y, rgba);
+                    unsigned int mask = VisibleMask(block, blockCount);
+                    ReserveQuad();
+                    if (mask == (1u << blockCount) - 1 && batchCapacity - quadsToRender >= (unsigned long) blockCount) {
+                        CopyMemory(((Instance*) vertexBuffer) + quadsToRender, block, sizeof(Instance) * blockCount);
+                        quadsToRender += blockCount;
+                        stats.quads += blockCount;
+                        continue;
+                    }
+                    for (int j = 0; j < blockCount; j++) {
+                        if (!(mask & (1u << j))) {
+                            stats.culled++;
+                            continue;
+                        }
+                        ReserveQuad();
+                        ((Instance*) vertexBuffer)[quadsToRender++] = block[j];
+                        stats.quads++;
+                    }
+                }
+            }
+        };
+
+        // Everything needed to draw one frame, recorded by the game thread for the RenderThread
+        struct FramePacket {
+            static constexpr int maxTexts = 16;
+            static constexpr int maxTextLength = 128;
+            struct Text {
+                Renderer::Point2f position;
+                char text[maxTextLength];
+                int scale;
+                Renderer::Color color;
+            };
+            Renderer::Instance* instances = 0;
+            unsigned long instanceCount = 0;
+            unsigned long instanceCapacity = 0;
+            Text texts[maxTexts];
+            int textCount = 0;
+            Renderer::Color clearColor;
+            unsigned long clientWidth = 0;
+            unsigned long clientHeight = 0;
+            // Stats of the last frame drawn from this packet, filled by the render thread
+            Renderer::FrameStats stats;
+
+            void Reset(unsigned long width, unsigned long height, Renderer::Color clear) {
+                instanceCount = 0;
+                textCount = 0;
+                clientWidth = width;
+                clientHeight = height;
+                clearColor = clear;
+            }
+
+            void AddInstance(const Renderer::Instance& instance) {
+                if (instanceCount == instanceCapacity) {
+                    instanceCapacity = instanceCapacity ? instanceCapacity * 2 : 1024;
+                    instances = instances
+                        ? (Renderer::Instance*) HeapReAlloc(GetProcessHeap(), 0, instances, sizeof(Renderer::Instance) * instanceCapacity)
+                        : (Renderer::Instance*) HeapAlloc(GetProcessHeap(), 0, sizeof(Renderer::Instance) * instanceCapacity);
+                    assert(instances && "Couldn't grow a frame packet");
+                }
+                instances[instanceCount++] = instance;
+            }
+
+            void AddSprite(Renderer::Point2f position, Renderer::Point2i size, Renderer::Texture texture, Renderer::Color color) {
+                AddInstance(Renderer::MakeInstance(position, size, texture, color));
+            }
+
+            // Axis aligned quads only, as with the Instances layout. Fractions of a texel in the uvs are kept (see Instance::SetTexture)
+            void AddQuad(Renderer::Quad quad) {
+                Renderer::Texture texture(0, 0, 0, 0, (int) quad.d.layer);
+                Renderer::Point2i size((int) (quad.b.x - quad.d.x), (int) (quad.b.y - quad.d.y));
+                Renderer::Instance instance = Renderer::MakeInstance(Renderer::Point2f(quad.d.x, quad.d.y), size, texture, Renderer::Color(quad.d.r, quad.d.g, quad.d.b, quad.d.a));
+                instance.SetTexture(quad.d.u, quad.d.v, quad.b.u, quad.b.v, (int) quad.d.layer);
+                AddInstance(instance);
+            }
+
+            // Drawn with the font of the RenderThread. The text is copied (and cut at maxTextLength - 1)
+            void AddText(Renderer::Point2f position, const char* text, int scale, Renderer::Color color) {
+                assert(textCount < maxTexts && "Too many texts in a frame packet");
+                Text& entry = texts[textCount++];
+                entry.position = position;
+                entry.scale = scale;
+                entry.color = color;
+                int i = 0;
+                for (; i < maxTextLength - 1 && text[i]; i++) {
+                    entry.text[i] = text[i];
+                }
+                entry.text[i] = 0;
+            }
+        };
+
+        // Owns the gl context and draws the frame packets the game thread submits, so that the game thread can work on the next
+        // frame while this one is being submitted and swapped. Two packets go back and forth: packetBusy[i] is 1 from the moment
+        // the game thread submits packet i until the render thread is done with it. Only Interlocked operations touch it, the
+        // events are there to sleep on instead of spinning.
+        struct RenderThread {
+            Renderer* renderer = 0;
+            Renderer::Font font;
+            HDC deviceContext = 0;
+            HGLRC context = 0;
+            HANDLE thread = 0;
+            HANDLE packetReady = 0;
+            HANDLE packetFree = 0;
+            FramePacket packets[2];
+            volatile LONG packetBusy[2] = {};
+            volatile LONG quit = 0;
+            int writeIndex = 0;
+            // What the game thread can show of the render side, as of the last packet it got back
+            Renderer::FrameStats lastFrameStats;
+            // Packets with at least this many instances per pool thread are recorded in parallel (when the renderer has a pool)
+            static constexpr unsigned long instancesPerSlice = 4096;
+
+            struct RecordPacketJob {
+                Renderer::RecordingContext* contexts;
+                const Renderer::Instance* instances;
+                unsigned long count;
+                int slices;
+            };
+
+            // Task i culls and records slice i of the packet's instances into recording context i
+            static void RecordPacketTask(void* data, int task) {
+                RecordPacketJob* job = (RecordPacketJob*) data;
+                unsigned long first = job->count * task / job->slices;
+                unsigned long end = job->count * (task + 1) / job->slices;
+                Renderer::RecordingContext& context = job->contexts[task];
+                for (unsigned long i = first; i < end; i++) {
+                    context.AddInstance(job->instances[i]);
+                }
+            }
+
+            // Call it from the thread that owns the gl context (with the renderer already initialized), it hands the context over
+            void Start(Renderer* newRenderer, HDC newDeviceContext, Renderer::Font newFont) {
+                renderer = newRenderer;
+                deviceContext = newDeviceContext;
+                font = newFont;
+                context = wglGetCurrentContext();
+                wglMakeCurrent(NULL, NULL);
+                packetReady = CreateEvent(NULL, FALSE, FALSE, NULL);
+                packetFree = CreateEvent(NULL, FALSE, FALSE, NULL);
+                thread = CreateThread(NULL, 0, Main, this, 0, NULL);
+                assert(thread && "Couldn't create the render thread");
+            }
+
+            // Lets the render thread draw the packets already submitted, then stops it and gives the gl context back to the calling thread
+            void Stop() {
+                InterlockedExchange(&quit, 1);
+                SetEvent(packetReady);
+                WaitForSingleObject(thread, INFINITE);
+                CloseHandle(thread);
+                CloseHandle(packetReady);
+                CloseHandle(packetFree);
+                wglMakeCurrent(deviceContext, context);
+            }
+
+            // Returns the packet to record the next frame in, waiting for the render thread to be done with it if needed
+            FramePacket* BeginPacket(unsigned long clientWidth, unsigned long clientHeight, Renderer::Color clearColor) {
+                PROFILE_ZONE("Wait for packet");
+                while (InterlockedCompareExchange(&packetBusy[writeIndex], 0, 0)) {
+                    WaitForSingleObject(packetFree, INFINITE);
+                }
+                FramePacket* packet = &packets[writeIndex];
+                lastFrameStats = packet->stats;
+                packet->Reset(clientWidth, clientHeight, clearColor);
+                return packet;
+            }
+
+            void SubmitPacket() {
+                InterlockedExchange(&packetBusy[writeIndex], 1);
+                SetEvent(packetReady);
+                writeIndex ^= 1;
+            }
+
+            void Draw(FramePacket& packet) {
+                PROFILE_ZONE("Draw packet");
+                renderer->BeginFrame(packet.clientWidth, packet.clientHeight, packet.clearColor);
+                int slices = 0;
+                if (renderer->pool) {
+                    slices = (int) (packet.instanceCount / instancesPerSlice);
+                    if (slices > renderer->pool->threadCount + 1) slices = renderer->pool->threadCount + 1;
+                    if (slices > Renderer::maxRecordingContexts) slices = Renderer::maxRecordingContexts;
+                }
+                if (slices > 1) {
+                    // Big packets are culled and recorded on the pool, then stitched in order before the texts so they stay on top
+                    for (int i = 0; i < slices; i++) {
+                        renderer->GetRecordingContext(i);
+                    }
+                    RecordPacketJob job = { renderer->recordings, packet.instances, packet.instanceCount, slices };
+                    renderer->pool->Run(RecordPacketTask, &job, slices);
+                    renderer->FlushRecordings();
+                }
+                else {
+                    for (unsigned long i = 0; i < packet.instanceCount; i++) {
+                        renderer->AddInstance(packet.instances[i]);
+                    }
+                }
+                for (int i = 0; i < packet.textCount; i++) {
+                    FramePacket::Text& text = packet.texts[i];
+                    renderer->AddText(text.position, text.text, font, text.scale, text.color);
+                }
+                renderer->Render(packet.clientWidth, packet.clientHeight, packet.clearColor, deviceContext);
+                if (false && GetErrors("Render Thread")) {
+                    Print("There were gl errors!");
+                }
+                packet.stats = renderer->lastFrameStats;
+            }
+
+            static DWORD WINAPI Main(LPVOID parameter) {
+                RenderThread* self = (RenderThread*) parameter;
+                wglMakeCurrent(self->deviceContext, self->context);
+                int readIndex = 0;
+                for (;;) {
+                    while (!InterlockedCompareExchange(&self->packetBusy[readIndex], 0, 0)) {
+                        if (self->quit) {
+                            wglMakeCurrent(NULL, NULL);
+                            return 0;
+                        }
+                        WaitForSingleObject(self->packetReady, INFINITE);
+                    }
+                    self->Draw(self->packets[readIndex]);
+                    InterlockedExchange(&self->packetBusy[readIndex], 0);
+                    SetEvent(self->packetFree);
+                    readIndex ^= 1;
+                }
+            }
+        };
+
+        // Writes quadCount random quads (about half of them off screen) as instances with the scalar and, if built with AVX2, the
+        // AVX2 kernel of AddQuads and prints quads per second for each (--bench quads). No gl involved, so it can run without a context
+        void BenchmarkAddQuads(unsigned long quadCount) {
+            HANDLE heap = GetProcessHeap();
+            Renderer::QuadSpan span;
+            float* x = (float*) HeapAlloc(heap, 0, sizeof(float) * quadCount);
+            float* y = (float*) HeapAlloc(heap, 0, sizeof(float) * quadCount);
+            float* w = (float*) HeapAlloc(heap, 0, sizeof(float) * quadCount);
+            float* h = (float*) HeapAlloc(heap, 0, sizeof(float) * quadCount);
+            unsigned short* rect = (unsigned short*) HeapAlloc(heap, 0, sizeof(unsigned short) * quadCount);
+            unsigned int* color = (unsigned int*) HeapAlloc(heap, 0, sizeof(unsigned int) * quadCount);
+            Renderer::Instance* out = (Renderer::Instance*) HeapAlloc(heap, 0, sizeof(Renderer::Instance) * quadCount);
+            Renderer::Texture rects[16];
+            for (int i = 0; i < 16; i++) {
+                rects[i] = Renderer::Texture((i % 4) * 32, (i / 4) * 32, (i % 4) * 32 + 32, (i / 4) * 32 + 32, i % 2);
+            }
+            unsigned int random = 12345;
+            for (unsigned long i = 0; i < quadCount; i++) {
+                random = random * 1664525 + 1013904223;
+                x[i] = (float) ((random >> 8) % 2560) - 640.0f;
+                y[i] = (float) ((random >> 16) % 1440) - 360.0f;
+                w[i] = h[i] = 32.0f;
+                rect[i] = (unsigned short) (random % 16);
+                color[i] = random | 0xFF000000;
+            }
+            span.count = quadCount;
+            span.x = x;
+            span.y = y;
+            span.w = w;
+            span.h = h;
+            span.rect = rect;
+            span.color = color;
+            span.rects = rects;
+            const GLfloat viewport[4] = { 0.0f, 0.0f, 1280.0f, 720.0f };
+            unsigned long long counter, frequency;
+            double ms;
+            unsigned long long fps;
+            GetCpuCounterAndFrequencySeconds(&counter, &frequency);
+            unsigned long written = Renderer::WriteInstancesScalar(out, span, 0, quadCount, viewport);
+            counter = GetTimeDifferenceMsAndFPS(counter, frequency, &ms, &fps);
+            FormattedPrint("AddQuads scalar: %d quads (%d visible) in %d us, %d Mquads/s\n", (int) quadCount, (int) written, (int) (ms * 1000.0), (int) (quadCount / (ms * 1000.0)));
+            #if defined(__AVX2__)
+            written = Renderer::WriteInstancesAvx2(out, span, 0, quadCount, viewport);
+            GetTimeDifferenceMsAndFPS(counter, frequency, &ms, &fps);
+            FormattedPrint("AddQuads avx2:   %d quads (%d visible) in %d us, %d Mquads/s\n", (int) quadCount, (int) written, (int) (ms * 1000.0), (int) (quadCount / (ms * 1000.0)));
+            #endif
+            HeapFree(heap, 0, x);
+            HeapFree(heap, 0, y);
+            HeapFree(heap, 0, w);
+            HeapFree(heap, 0, h);
+            HeapFree(heap, 0, rect);
+            HeapFree(heap, 0, color);
+            HeapFree(heap, 0, out);
+        }
+
+        struct RecordingBenchmark {
+            Renderer::RecordingContext* contexts;
+            unsigned long quadsPerContext;
+        };
+
+        static void RecordingBenchmarkTask(void* data, int task) {
+            RecordingBenchmark* benchmark = (RecordingBenchmark*) data;
+            Renderer::RecordingContext& context = benchmark->contexts[task];
+            context.count = 0;
+            Renderer::Texture texture(0, 0, 16, 16, 0);
+            for (unsigned long i = 0; i < benchmark->quadsPerContext; i++) {
+                float x = (float) ((i * 37 + task * 11) % 1280);
+                float y = (float) ((i * 13 + task * 7) % 720);
+                context.AddSprite(Renderer::Point2f(x, y), Renderer::Point2i(16, 16), texture, Renderer::Color(1.0f, 1.0f, 1.0f, 1.0f));
+            }
+        }
+
+        // Records quadCount quads split across 1 to maxThreads threads, then stitches them, and prints how long it took for each
+        // thread count (--bench recording). No gl involved, so it can run without a context
+        void BenchmarkRecording(unsigned long quadCount, int maxThreads) {
+            static Renderer::RecordingContext contexts[Renderer::maxRecordingContexts];
+            Renderer::Instance* out = (Renderer::Instance*) HeapAlloc(GetProcessHeap(), 0, sizeof(Renderer::Instance) * quadCount);
+            if (maxThreads > Renderer::maxRecordingContexts) maxThreads = Renderer::maxRecordingContexts;
+            for (int threads = 1; threads <= maxThreads; threads++) {
+                ThreadPool pool;
+                pool.Initialize(threads - 1);
+                RecordingBenchmark benchmark = { contexts, quadCount / threads };
+                unsigned long long counter, frequency;
+                double recordMs, stitchMs;
+                unsigned long long fps;
+                GetCpuCounterAndFrequencySeconds(&counter, &frequency);
+                pool.Run(RecordingBenchmarkTask, &benchmark, threads);
+                counter = GetTimeDifferenceMsAndFPS(counter, frequency, &recordMs, &fps);
+                unsigned long total = Renderer::PrefixSumRecordings(contexts, threads);
+                Renderer::CopyRecordings(out, contexts, threads, 0, total, &pool);
+                GetTimeDifferenceMsAndFPS(counter, frequency, &stitchMs, &fps);
+                FormattedPrint("Recording: %d threads, %d quads, record %d us, stitch %d us\n", threads, (int) total, (int) (recordMs * 1000.0), (int) (stitchMs * 1000.0));
+                pool.Release();
+            }
+            HeapFree(GetProcessHeap(), 0, out);
+        }
+
+        // Lays out a line of HUD text once and then copies it around as AddText does for cached strings until glyphCount glyphs
+        // are made, printing how long the copies took (--bench text). No gl involved, so it can run without a context
+        void BenchmarkText(int glyphCount) {
+            Renderer::Font font(Renderer::Texture(0, 0, 128, 128, 0), 8, 8);
+            Renderer::TextCache cache;
+            const char* text = "ms: 16.666 fps: 60 quads: 123456 flushes: 12 draw calls: 34";
+            unsigned long long counter, frequency;
+            GetCpuCounterAndFrequencySeconds(&counter, &frequency);
+            Renderer::TextCache::TextRun* run = cache.Get(text, font, 2);
+            double layoutMs;
+            unsigned long long fps;
+            counter = GetTimeDifferenceMsAndFPS(counter, frequency, &layoutMs, &fps);
+            Renderer::Instance* out = (Renderer::Instance*) HeapAlloc(GetProcessHeap(), 0, sizeof(Renderer::Instance) * (glyphCount + run->glyphCount));
+            int made = 0;
+            for (int line = 0; made < glyphCount; line++) {
+                run = cache.Get(text, font, 2);
+                Renderer::OffsetInstances(out + made, run->glyphs, run->glyphCount, 10.0f, (float) (line * 16), 0xFFFFFFFF);
+                made += run->glyphCount;
+            }
+            double copyMs;
+            GetTimeDifferenceMsAndFPS(counter, frequency, &copyMs, &fps);
+            FormattedPrint("Text: layout of %d glyphs %d us, %d cached glyphs %d us\n",
+                run->glyphCount, (int)(layoutMs * 1000.0), made, (int)(copyMs * 1000.0));
+            HeapFree(GetProcessHeap(), 0, out);
+        }
+
+        // Packs spriteCount random sprites (4x4 to 32x32) into 1024x1024 pages and prints how long it took (--bench atlas).
+        // No gl involved, so it can run without a context
+        void BenchmarkAtlasPacking(int spriteCount) {
+            static unsigned char pixels[32 * 32 * 4];
+            Renderer::Atlas atlas;
+            atlas.Initialize(1024, 1024, 64);
+            unsigned int random = 12345;
+            unsigned long long counter, frequency;
+            GetCpuCounterAndFrequencySeconds(&counter, &frequency);
+            int packed = 0;
+            for (int i = 0; i < spriteCount; i++) {
+                random = random * 1664525 + 1013904223;
+                int w = 4 + (random >> 8) % 29;
+                int h = 4 + (random >> 18) % 29;
+                if (atlas.Insert(pixels, w, h) >= 0) packed++;
+            }
+            double insertMs;
+            unsigned long long fps;
+            counter = GetTimeDifferenceMsAndFPS(counter, frequency, &insertMs, &fps);
+            atlas.Defragment();
+            double defragmentMs;
+            GetTimeDifferenceMsAndFPS(counter, frequency, &defragmentMs, &fps);
+            FormattedPrint("Atlas: %d/%d sprites packed in %d pages. Insert %d us, defragment %d us\n",
+                packed, spriteCount, atlas.pagesUsed, (int)(insertMs * 1000.0), (int)(defragmentMs * 1000.0));
+            atlas.Release();
+        }
+    }
+}
+
+namespace Win32 {
+    namespace SOFTWARE {
+        // Same surface as GL::Renderer (LoadTexture, AddQuad, Render) but rasterized on the cpu into an RGBA8 framebuffer, for machines
+        // without a usable gpu and for running the renderer without a window. It follows vshader/fshader: texel space uvs over a
+        // textureArrayWidth x textureArrayHeight array that repeats, nearest filtering, texture times vertex color, and
+        // glBlendFuncSeparate(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_ONE, GL_ZERO).
+        // Quads are expected to be axis aligned (as in the Instances layout of GL::Renderer), d is the top left corner and b the
+        // bottom right one. The screen is split in tiles, quads are binned into the tiles they touch and each tile is rasterized
+        // on its own (on the pool, if there is one), always in submission order, so the result doesn't depend on the thread count.
+        // No gpu needed, but it is still Win32 code like the rest of the file: memory comes from HeapAlloc, the pool runs on Win32
+        // threads and Render presents with StretchDIBits (--headless skips that last part).
+        struct Renderer {
+            typedef GL::Renderer::Color Color;
+            typedef GL::Renderer::Point2i Point2i;
+            typedef GL::Renderer::Point2f Point2f;
+            typedef GL::Renderer::Vertex Vertex;
+            typedef GL::Renderer::Quad Quad;
+            typedef GL::Renderer::Texture Texture;
+            typedef GL::Renderer::Instance Instance;
+            typedef GL::Renderer::Atlas Atlas;
+
+            // Same meaning as in GL::Renderer, the atlas pages are the layers
+            unsigned long textureArrayWidth = 256;
+            unsigned long textureArrayHeight = 256;
+            unsigned long textureArrayLayers = 16;
+            Atlas atlas;
+
+            // Pixels are RGBA8 with r in the lowest byte, rows top to bottom
+            unsigned int* framebuffer = 0;
+            // The framebuffer in BGRA for StretchDIBits
+            unsigned int* presentBuffer = 0;
+            int width = 0;
+            int height = 0;
+
+            // A quad ready to be rasterized
+            struct Sprite {
+                float x1, y1, x2, y2;
+                float u1, v1, u2, v2;
+                unsigned int color;
+                int layer;
+            };
+            Sprite* sprites = 0;
+            unsigned long spriteCount = 0;
+            unsigned long spriteCapacity = 0;
+
+            static constexpr int tileSize = 64;
+            struct Tile {
+                unsigned long* sprites;
+                unsigned long count;
+                unsigned long capacity;
+            };
+            Tile* tiles = 0;
+            int tilesX = 0;
+            int tilesY = 0;
+            // Rasterizes the tiles in parallel, optional
+            ThreadPool* pool = 0;
+
+            struct FrameStats {
+                unsigned long quads;
+                // Quads completely outside of the framebuffer, or on a layer with no atlas page
+                unsigned long culled;
+                // Sum over the tiles of the quads binned in them
+                unsigned long binned;
+                FrameStats() : quads(0), culled(0), binned(0) {}
+            };
+            FrameStats stats;
+            FrameStats lastFrameStats;
+
+            bool frameBegun = false;
+            unsigned int clearPixel = 0;
+
+            static int FloorToInt(float x) {
+                int i = (int) x;
+                return (float) i > x ? i - 1 : i;
+            }
+
+            static int CeilToInt(float x) {
+                int i = (int) x;
+                return (float) i < x ? i + 1 : i;
+            }
+
+            static unsigned int PackColor(Color color) {
+                return ((unsigned int) Color::ToByte(color.r))
+                    | ((unsigned int) Color::ToByte(color.g) << 8)
+                    | ((unsigned int) Color::ToByte(color.b) << 16)
+                    | ((unsigned int) Color::ToByte(color.a) << 24);
+            }
+
+            void Initialize() {
+                // Sprites come through GL::Renderer::Instance, so the same limits apply
+                assert(textureArrayWidth * 2 - 1 <= GL::Renderer::maxPackedTexel && textureArrayHeight * 2 - 1 <= GL::Renderer::maxPackedTexel && "The texture array is too big");
+                assert(textureArrayLayers <= GL::Renderer::maxPackedLayers && "The texture array has too many layers");
+                atlas.Initialize(textureArrayWidth, textureArrayHeight, textureArrayLayers);
+            }
+
+            // Packs an RGBA image into the atlas and returns the Texture covering it, as GL::Renderer::LoadTexture
+            Texture LoadTexture(void* data, int w, int h) {
+                int id = atlas.Insert(data, w, h);
+                assert(id >= 0 && "The texture array is full");
+                return atlas.Get(id);
+            }
+
+            void Resize(int newWidth, int newHeight) {
+                HANDLE heap = GetProcessHeap();
+                if (framebuffer) {
+                    HeapFree(heap, 0, framebuffer);
+                    HeapFree(heap, 0, presentBuffer);
+                    for (int i = 0; i < tilesX * tilesY; i++) {
+                        if (tiles[i].sprites) HeapFree(heap, 0, tiles[i].sprites);
+                    }
+                    HeapFree(heap, 0, tiles);
+                }
+                width = newWidth;
+                height = newHeight;
+                framebuffer = (unsigned int*) HeapAlloc(heap, 0, sizeof(unsigned int) * width * height);
+                presentBuffer = (unsigned int*) HeapAlloc(heap, 0, sizeof(unsigned int) * width * height);
+                tilesX = (width + tileSize - 1) / tileSize;
+                tilesY = (height + tileSize - 1) / tileSize;
+                tiles = (Tile*) HeapAlloc(heap, HEAP_ZERO_MEMORY, sizeof(Tile) * tilesX * tilesY);
+                assert(framebuffer && presentBuffer && tiles && "Couldn't allocate the software framebuffer");
+            }
+
+            // Frees the framebuffer, the bins and the atlas
+            void Release() {
+                HANDLE heap = GetProcessHeap();
+                if (framebuffer) {
+                    HeapFree(heap, 0, framebuffer);
+                    HeapFree(heap, 0, presentBuffer);
+                    for (int i = 0; i < tilesX * tilesY; i++) {
+                        if (tiles[i].sprites) HeapFree(heap, 0, tiles[i].sprites);
+                    }
+                    HeapFree(heap, 0, tiles);
+                }
+                if (sprites) HeapFree(heap, 0, sprites);
+                framebuffer = presentBuffer = 0;
+                tiles = 0;
+                sprites = 0;
+                width = height = tilesX = tilesY = 0;
+                spriteCount = spriteCapacity = 0;
+                atlas.Release();
             }
 
-            void GenerateShaderProgram() {
-                shaderProgramObject = glCreateProgram();
-                glAttachShader(shaderProgramObject, vertexShaderObject);
-                glAttachShader(shaderProgramObject, fragmentShaderObject);
-                glLinkProgram(shaderProgramObject);
-                int success;
-                glGetProgramiv(shaderProgramObject, GL_LINK_STATUS, &success);
-                if(success == 0) {
-                    char info[512];
-                    glGetProgramInfoLog(shaderProgramObject, 512, NULL, info);
-                    FormattedPrint("Error linking shader program:\n\t%s", info);
+            // Call it before adding quads, AddSprite asserts that it was. Render() calls it itself if the frame had no quads at all
+            void BeginFrame(unsigned long clientWidth, unsigned long clientHeight, Color clearColor) {
+                if ((int) clientWidth != width || (int) clientHeight != height) {
+                    Resize(clientWidth, clientHeight);
                 }
-                glDeleteShader(vertexShaderObject);
-                glDeleteShader(fragmentShaderObject);
-                GetErrors(__FUNCTION__);
+                clearPixel = PackColor(clearColor);
+                spriteCount = 0;
+                for (int i = 0; i < tilesX * tilesY; i++) {
+                    tiles[i].count = 0;
+                }
+                frameBegun = true;
             }
-            
-            void LoadTexture(void* data, GLsizei w, GLsizei h) {
-                textureDimensions[0] = w;
-                textureDimensions[1] = h;
-                glBindTexture(GL_TEXTURE_2D, textureObject);
-                glTexImage2D(GL_TEXTURE_2D, 0, 4, w, h, 0, GL_RGBA, GL_UNSIGNED_BYTE, data);
-                glBindTexture(GL_TEXTURE_2D, 0);
-                GetErrors(__FUNCTION__);
+
+            void AddSprite(const Sprite& sprite) {
+                assert(frameBegun && "BeginFrame must be called before adding quads to the software renderer");
+                // Nothing to sample from a layer that isn't an atlas page in use (no texture loaded yet, or a stale or bad layer)
+                if (sprite.layer < 0 || sprite.layer >= atlas.pagesUsed || !atlas.pages[sprite.layer].pixels) {
+                    stats.culled++;
+                    return;
+                }
+                // Pixels whose centers are inside of the quad
+                int left = CeilToInt(sprite.x1 - 0.5f), right = CeilToInt(sprite.x2 - 0.5f);
+                int top = CeilToInt(sprite.y1 - 0.5f), bottom = CeilToInt(sprite.y2 - 0.5f);
+                if (left < 0) left = 0;
+                if (top < 0) top = 0;
+                if (right > width) right = width;
+                if (bottom > height) bottom = height;
+                if (left >= right || top >= bottom) {
+                    stats.culled++;
+                    return;
+                }
+                if (spriteCount == spriteCapacity) {
+                    spriteCapacity = spriteCapacity ? spriteCapacity * 2 : 4096;
+                    sprites = sprites
+                        ? (Sprite*) HeapReAlloc(GetProcessHeap(), 0, sprites, sizeof(Sprite) * spriteCapacity)
+                        : (Sprite*) HeapAlloc(GetProcessHeap(), 0, sizeof(Sprite) * spriteCapacity);
+                }
+                sprites[spriteCount] = sprite;
+                for (int tileY = top / tileSize; tileY <= (bottom - 1) / tileSize; tileY++) {
+                    for (int tileX = left / tileSize; tileX <= (right - 1) / tileSize; tileX++) {
+                        Tile& tile = tiles[tileY * tilesX + tileX];
+                        if (tile.count == tile.capacity) {
+                            tile.capacity = tile.capacity ? tile.capacity * 2 : 256;
+                            tile.sprites = tile.sprites
+                                ? (unsigned long*) HeapReAlloc(GetProcessHeap(), 0, tile.sprites, sizeof(unsigned long) * tile.capacity)
+                                : (unsigned long*) HeapAlloc(GetProcessHeap(), 0, sizeof(unsigned long) * tile.capacity);
+                        }
+                        tile.sprites[tile.count++] = spriteCount;
+                        stats.binned++;
+                    }
+                }
+                spriteCount++;
+                stats.quads++;
             }
 
-            void Initialize() {
-                // Something about windows and framerates, dont remember, probably vertical sync
-                wglSwapIntervalEXT(1);
-                
-                // Configure textures
-                // Load them later with LoadTexture()
-                glEnable(GL_TEXTURE_2D);
-                glGenTextures(1, &textureObject);
-                glBindTexture(GL_TEXTURE_2D, textureObject);
-                glActiveTexture(GL_TEXTURE0);
-                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-                glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-                glBindTexture(GL_TEXTURE_2D, 0);
-                
-                // Configure Blending
-                glEnable(GL_BLEND);
-                glBlendFuncSeparate(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_ONE, GL_ZERO);
+            void AddQuad(Quad quad) {
+                Sprite sprite;
+                sprite.x1 = quad.d.x;
+                sprite.y1 = quad.d.y;
+                sprite.x2 = quad.b.x;
+                sprite.y2 = quad.b.y;
+                sprite.u1 = quad.d.u;
+                sprite.v1 = quad.d.v;
+                sprite.u2 = quad.b.u;
+                sprite.v2 = quad.b.v;
+                sprite.color = PackColor(Color(quad.d.r, quad.d.g, quad.d.b, quad.d.a));
+                sprite.layer = (int) quad.d.layer;
+                AddSprite(sprite);
+            }
 
-                // Generate the vertex array object and configure it
-                glGenVertexArrays(1, &vertexArrayObject);
-                glBindVertexArray(vertexArrayObject);
+            void AddInstance(const Instance& instance) {
+                Sprite sprite;
+                sprite.x1 = instance.x;
+                sprite.y1 = instance.y;
+                sprite.x2 = instance.x + instance.w;
+                sprite.y2 = instance.y + instance.h;
+                sprite.u1 = instance.U1() + instance.SubTexelU();
+                sprite.v1 = instance.V1() + instance.SubTexelV();
+                sprite.u2 = instance.U2() + instance.SubTexelU();
+                sprite.v2 = instance.V2() + instance.SubTexelV();
+                CopyMemory(&sprite.color, &instance.r, 4);
+                sprite.layer = instance.Layer();
+                AddSprite(sprite);
+            }
 
-                // Generate an element buffer object for the indices
-                glGenBuffers(1, &elementBufferObject);
-                glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, elementBufferObject);
-                // It's an static buffer so we can just load it now on initialization and forget about it
-                unsigned long indices[maxIndices];
-                for (int i = 0; i < maxQuads; i++) {
-                    int vertex = i * 4; // 4 vertices per quad
-                    int index = i * 6; // 6 indices per quad
-                    indices[index + 0] = vertex + 0;
-                    indices[index + 1] = vertex + 1;
-                    indices[index + 2] = vertex + 2;
-                    indices[index + 3] = vertex + 0;
-                    indices[index + 4] = vertex + 2;
-                    indices[index + 5] = vertex + 3;
-                }
-                glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(unsigned long) * maxIndices, indices, GL_STATIC_DRAW);
-                
-                // vertex buffer object
-                glGenBuffers(1, &vertexBufferObject);
-                glBindBuffer(GL_ARRAY_BUFFER, vertexBufferObject);
-                for (int i = 0; i < maxVertices; i++) {
-                    vertexBuffer[i].Zero();
+            void AddSprite(Point2f position, Point2i size, Texture texture, Color color) {
+                AddInstance(GL::Renderer::MakeInstance(position, size, texture, color));
+            }
+
+            // x / 255 rounded, for x up to 255 * 255, in every 16 bit lane
+            static __m128i Divide255(__m128i x) {
+                x = _mm_add_epi16(x, _mm_set1_epi16(128));
+                return _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+            }
+
+            static unsigned int Divide255(unsigned int x) {
+                x += 128;
+                return (x + (x >> 8)) >> 8;
+            }
+
+            // Blends texel * color over pixel, the scalar version of BlendSpan4
+            static unsigned int BlendPixel(unsigned int texel, unsigned int color, unsigned int pixel) {
+                unsigned int source[4], result = 0;
+                for (int channel = 0; channel < 4; channel++) {
+                    source[channel] = Divide255(((texel >> (channel * 8)) & 0xFF) * ((color >> (channel * 8)) & 0xFF));
                 }
-                glBufferData(GL_ARRAY_BUFFER, sizeof(Vertex) * maxVertices, vertexBuffer, GL_DYNAMIC_DRAW);
+                unsigned int alpha = source[3];
+                for (int channel = 0; channel < 3; channel++) {
+                    unsigned int destination = (pixel >> (channel * 8)) & 0xFF;
+                    result |= Divide255(source[channel] * alpha + destination * (255 - alpha)) << (channel * 8);
+                }
+                return result | (alpha << 24);
+            }
 
-                // Configure the vertex layer
-                glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 8 * sizeof(float), (void*)(0));
-                glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 8 * sizeof(float), (void*)(2 * sizeof(float)));
-                glVertexAttribPointer(2, 4, GL_FLOAT, GL_FALSE, 8 * sizeof(float), (void*)(4 * sizeof(float)));
-                glEnableVertexAttribArray(0);
-                glEnableVertexAttribArray(1);
-                glEnableVertexAttribArray(2);
+            // Blends 4 texels * color over 4 pixels, 2 pixels per register as 16 bit lanes
+            static __m128i BlendSpan4(__m128i texels, __m128i color, __m128i pixels) {
+                __m128i zero = _mm_setzero_si128();
+                // Lanes 3 and 7, the alphas
+                __m128i alphaLanes = _mm_setr_epi16(0, 0, 0, -1, 0, 0, 0, -1);
+                __m128i colorWide = _mm_unpacklo_epi8(color, zero);
+                __m128i halves[2];
+                for (int half = 0; half < 2; half++) {
+                    __m128i source = half ? _mm_unpackhi_epi8(texels, zero) : _mm_unpacklo_epi8(texels, zero);
+                    __m128i destination = half ? _mm_unpackhi_epi8(pixels, zero) : _mm_unpacklo_epi8(pixels, zero);
+                    source = Divide255(_mm_mullo_epi16(source, colorWide));
+                    __m128i alpha = _mm_shufflehi_epi16(_mm_shufflelo_epi16(source, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+                    __m128i inverse = _mm_sub_epi16(_mm_set1_epi16(255), alpha);
+                    __m128i blended = Divide255(_mm_add_epi16(_mm_mullo_epi16(source, alpha), _mm_mullo_epi16(destination, inverse)));
+                    // GL_ONE, GL_ZERO for the alpha
+                    halves[half] = _mm_or_si128(_mm_andnot_si128(alphaLanes, blended), _mm_and_si128(alphaLanes, source));
+                }
+                return _mm_packus_epi16(halves[0], halves[1]);
+            }
 
-                // Finish, unbind everything
-                glBindVertexArray(0);
-                glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
-                glBindBuffer(GL_ARRAY_BUFFER, 0);
+            // Wraps a texel coordinate into [0, size)
+            static int Wrap(int texel, int size) {
+                texel %= size;
+                return texel < 0 ? texel + size : texel;
             }
 
-            void Render(unsigned long clientWidth, unsigned long clientHeight, Color clearColor, HDC deviceContextHandle) {
-                glViewport(0, 0, clientWidth, clientHeight);
-                glClearColor(clearColor.r, clearColor.g, clearColor.b, clearColor.a);
-                glClear(GL_COLOR_BUFFER_BIT);
+            void RasterizeTile(int tileIndex) {
+                PROFILE_ZONE("Rasterize tile");
+                Tile& tile = tiles[tileIndex];
+                int tileLeft = (tileIndex % tilesX) * tileSize;
+                int tileTop = (tileIndex / tilesX) * tileSize;
+                int tileRight = tileLeft + tileSize < width ? tileLeft + tileSize : width;
+                int tileBottom = tileTop + tileSize < height ? tileTop + tileSize : height;
+                for (int y = tileTop; y < tileBottom; y++) {
+                    unsigned int* row = framebuffer + y * width;
+                    for (int x = tileLeft; x < tileRight; x++) {
+                        row[x] = clearPixel;
+                    }
+                }
+                int pageWidth = atlas.pageWidth;
+                int pageHeight = atlas.pageHeight;
+                static const int maxSpan = tileSize;
+                int texelColumns[maxSpan + 3];
+                for (unsigned long i = 0; i < tile.count; i++) {
+                    const Sprite& sprite = sprites[tile.sprites[i]];
+                    int left = CeilToInt(sprite.x1 - 0.5f), right = CeilToInt(sprite.x2 - 0.5f);
+                    int top = CeilToInt(sprite.y1 - 0.5f), bottom = CeilToInt(sprite.y2 - 0.5f);
+                    if (left < tileLeft) left = tileLeft;
+                    if (top < tileTop) top = tileTop;
+                    if (right > tileRight) right = tileRight;
+                    if (bottom > tileBottom) bottom = tileBottom;
+                    if (left >= right || top >= bottom) {
+                        continue;
+                    }
+                    const unsigned int* page = (const unsigned int*) atlas.pages[sprite.layer].pixels;
+                    float du = (sprite.u2 - sprite.u1) / (sprite.x2 - sprite.x1);
+                    float dv = (sprite.v2 - sprite.v1) / (sprite.y2 - sprite.y1);
+                    // The texel of every column of the span is the same on every row
+                    int spanLength = right - left;
+                    for (int x = 0; x < spanLength; x++) {
+                        float u = sprite.u1 + ((float) (left + x) + 0.5f - sprite.x1) * du;
+                        texelColumns[x] = Wrap(FloorToInt(u), pageWidth);
+                    }
+                    __m128i color = _mm_set1_epi32((int) sprite.color);
+                    for (int y = top; y < bottom; y++) {
+                        float v = sprite.v1 + ((float) y + 0.5f - sprite.y1) * dv;
+                        const unsigned int* texelRow = page + Wrap(FloorToInt(v), pageHeight) * pageWidth;
+                        unsigned int* pixels = framebuffer + y * width + left;
+                        int x = 0;
+                        for (; x + 4 <= spanLength; x += 4) {
+                            __m128i texels = _mm_setr_epi32((int) texelRow[texelColumns[x]], (int) texelRow[texelColumns[x + 1]], (int) texelRow[texelColumns[x + 2]], (int) texelRow[texelColumns[x + 3]]);
+                            __m128i destination = _mm_loadu_si128((const __m128i*) (pixels + x));
+                            _mm_storeu_si128((__m128i*) (pixels + x), BlendSpan4(texels, color, destination));
+                        }
+                        for (; x < spanLength; x++) {
+                            pixels[x] = BlendPixel(texelRow[texelColumns[x]], sprite.color, pixels[x]);
+                        }
+                    }
+                }
+            }
 
-                #define ToColumnMajor(v0,v1,v2,v3,v4,v5,v6,v7,v8,v9,v10,v11,v12,v13,v14,v15) v0,v4,v8,v12,v1,v5,v9,v13,v2,v6,v10,v14,v3,v7,v11,v15
-                GLfloat w = 2.0f/(float)clientWidth;
-                GLfloat h = 2.0f/(float)clientHeight;
-                GLfloat projectionMatrix[] = { ToColumnMajor(
-                    w,  0,  0, -1,
-                    0, -h,  0,  1,
-                    0,  0,  1,  0,
-                    0,  0,  0,  1
-                )};
-                #undef ToColumnMajor
+            static void RasterizeTileTask(void* data, int task) {
+                ((Renderer*) data)->RasterizeTile(task);
+            }
 
-                glBindVertexArray(vertexArrayObject);
-                glBindTexture(GL_TEXTURE_2D, textureObject);
-                glBindBuffer(GL_ARRAY_BUFFER, vertexBufferObject);
-                glBufferData(GL_ARRAY_BUFFER, sizeof(Vertex) * 4 * quadsToRender, vertexBuffer, GL_DYNAMIC_DRAW);
-                glUseProgram(shaderProgramObject);
-                GLint mvpUniformPosition = glGetUniformLocation(shaderProgramObject, "mvp");
-                GLint textureDimensionsUniformPosition = glGetUniformLocation(shaderProgramObject, "texture_dimensions");
-                glUniformMatrix4fv(mvpUniformPosition, 1, GL_FALSE, projectionMatrix);
-                glUniform2fv(textureDimensionsUniformPosition, 1, textureDimensions);
-                glDrawElements(GL_TRIANGLES, quadsToRender * 6, GL_UNSIGNED_INT, 0);
-                glBindVertexArray(0);
-                glBindTexture(GL_TEXTURE_2D, 0);
-                glBindBuffer(GL_ARRAY_BUFFER, 0);
+            // Rasterizes everything added since BeginFrame into the framebuffer
+            void Rasterize() {
+                if (pool) {
+                    pool->Run(RasterizeTileTask, this, tilesX * tilesY);
+                }
+                else {
+                    for (int i = 0; i < tilesX * tilesY; i++) {
+                        RasterizeTile(i);
+                    }
+                }
+            }
 
-                Win32::SwapPixelBuffers(deviceContextHandle);
-                quadsToRender = 0;
+            void Present(HDC deviceContextHandle) {
+                for (int i = 0; i < width * height; i++) {
+                    unsigned int pixel = framebuffer[i];
+                    presentBuffer[i] = (pixel & 0xFF00FF00) | ((pixel & 0xFF) << 16) | ((pixel >> 16) & 0xFF);
+                }
+                BITMAPINFO info = {};
+                info.bmiHeader.biSize = sizeof(info.bmiHeader);
+                info.bmiHeader.biWidth = width;
+                // Negative for rows top to bottom
+                info.bmiHeader.biHeight = -height;
+                info.bmiHeader.biPlanes = 1;
+                info.bmiHeader.biBitCount = 32;
+                info.bmiHeader.biCompression = BI_RGB;
+                StretchDIBits(deviceContextHandle, 0, 0, width, height, 0, 0, width, height, presentBuffer, &info, DIB_RGB_COLORS, SRCCOPY);
             }
-        
-            void AddQuad(Quad quad) {
-                vertexBuffer[quadsToRender+0] = quad.a;
-                vertexBuffer[quadsToRender+1] = quad.b;
-                vertexBuffer[quadsToRender+2] = quad.c;
-                vertexBuffer[quadsToRender+3] = quad.d;
-                quadsToRender++;
+
+            // Rasterizes the frame and shows it on the window of deviceContextHandle, if any (0 to only render into the framebuffer)
+            void Render(unsigned long clientWidth, unsigned long clientHeight, Color clearColor, HDC deviceContextHandle) {
+                if (!frameBegun) {
+                    BeginFrame(clientWidth, clientHeight, clearColor);
+                }
+                Rasterize();
+                if (deviceContextHandle) {
+                    Present(deviceContextHandle);
+                }
+                lastFrameStats = stats;
+                stats = FrameStats();
+                frameBegun = false;
             }
         };
     }
@@ -847,9 +4104,65 @@ namespace Win32 {
 // . #include <Mmreg.h>
 #include <windows.h>
 #include <mmsystem.h>
+// WAVE_FORMAT_IEEE_FLOAT and WAVE_FORMAT_EXTENSIBLE, for reading wav files
+#include <mmreg.h>
 #include <DSound.h>
 #pragma comment(lib, "gdi32.lib")
+#include "mixer.h"
 namespace Win32 {
+    // The mixer lives in mixer.h, away from anything windows
+    using Audio::Mixer;
+
+    // Mixes seconds worth of voiceCount voices of noise at different pitches and pans, and prints how much of one core it takes
+    // to keep up with samplesPerSecond (--bench mixer)
+    void BenchmarkMixer(int voiceCount, int samplesPerSecond, int seconds) {
+        HANDLE heap = GetProcessHeap();
+        Mixer* mixer = (Mixer*) HeapAlloc(heap, 0, sizeof(Mixer));
+        mixer->Initialize(samplesPerSecond);
+        Mixer::Sound sounds[2];
+        unsigned int seed = 1337;
+        for (int s = 0; s < 2; s++) {
+            sounds[s].channels = s + 1;
+            sounds[s].frameCount = samplesPerSecond;
+            sounds[s].samplesPerSecond = samplesPerSecond;
+            signed short* samples = (signed short*) HeapAlloc(heap, 0, sizeof(signed short) * sounds[s].frameCount * sounds[s].channels);
+            for (unsigned long i = 0; i < sounds[s].frameCount * sounds[s].channels; i++) {
+                seed = seed * 1103515245 + 12345;
+                samples[i] = (signed short) (seed >> 16);
+            }
+            sounds[s].samples = samples;
+        }
+        for (int v = 0; v < voiceCount; v++) {
+            mixer->Play(&sounds[v % 2], 1.0f / voiceCount, (float) (v % 21 - 10) / 10.0f, 0.5f + (float) (v % 13) / 8.0f, true);
+        }
+        unsigned long frames = (unsigned long) samplesPerSecond * seconds;
+        signed short out[2 * 512];
+        unsigned long long counter, frequency;
+        GetCpuCounterAndFrequencySeconds(&counter, &frequency);
+        for (unsigned long done = 0; done < frames; done += 512) {
+            mixer->Mix(out, 512);
+        }
+        double ms;
+        unsigned long long fps;
+        GetTimeDifferenceMsAndFPS(counter, frequency, &ms, &fps);
+        FormattedPrint("Mixer: %d voices, %d s of audio in %f ms, %f%% of a core\n", voiceCount, seconds, ms, ms / (seconds * 10.0));
+        HeapFree(heap, 0, (void*) sounds[0].samples);
+        HeapFree(heap, 0, (void*) sounds[1].samples);
+        HeapFree(heap, 0, mixer);
+    }
+
+    // One period of a square wave of hz, for a voice to loop
+    void MakeSquareWave(Mixer::Sound* sound, int samplesPerSecond, int hz, int volume) {
+        sound->channels = 1;
+        sound->samplesPerSecond = samplesPerSecond;
+        sound->frameCount = samplesPerSecond / hz;
+        signed short* samples = (signed short*) HeapAlloc(GetProcessHeap(), 0, sizeof(signed short) * sound->frameCount);
+        for (unsigned long i = 0; i < sound->frameCount; i++) {
+            samples[i] = (signed short) (i < sound->frameCount / 2 ? volume : -volume);
+        }
+        sound->samples = samples;
+    }
+
     namespace DSOUND {
         // https://docs.microsoft.com/en-us/previous-versions/windows/desktop/mt708921(v=vs.85)
         typedef HRESULT WINAPI directSoundCreate_t(LPCGUID pcGuidDevice, LPDIRECTSOUND *ppDS, LPUNKNOWN pUnkOuter);
@@ -893,272 +4206,1246 @@ namespace Win32 {
                     waveFormat.nAvgBytesPerSec = waveFormat.nSamplesPerSec*waveFormat.nBlockAlign;
                     waveFormat.cbSize = 0;
 
-                    // Cooperation level let's windows know how the application sound should interact with the rest of applications. Kind of
-                    // c calling:
-                    // if(SUCCEEDED(object->lpVtbl->SetCooperativeLevel(object, windowHandle, DSSCL_PRIORITY))) {
-                    // cpp calling:
-                    if(SUCCEEDED(object->SetCooperativeLevel(windowHandle, DSSCL_PRIORITY))) {
-                        Print("DirectSound: CooperationLevel changed.\n");
+                    // Cooperation level let's windows know how the application sound should interact with the rest of applications. Kind of
+                    // c calling:
+                    // if(SUCCEEDED(object->lpVtbl->SetCooperativeLevel(object, windowHandle, DSSCL_PRIORITY))) {
+                    // cpp calling:
+                    if(SUCCEEDED(object->SetCooperativeLevel(windowHandle, DSSCL_PRIORITY))) {
+                        Print("DirectSound: CooperationLevel changed.\n");
+
+                        // As far as I know, the reason we have to create a main buffer (which we won't use) and then later on a "secondary buffer"
+                        // which we will actually work with is because nowadays windows (?) doesn't allow to write to the sound hardware directly (the main buffer)
+                        // and instead every application uses a secondary buffer, and later on windows mix every secondary buffer and does the necessary work with
+                        // that main buffer. Something like that...
+                        DSBUFFERDESC bufferDescription = {};
+                        bufferDescription.dwSize = sizeof(bufferDescription);
+                        bufferDescription.dwFlags = DSBCAPS_PRIMARYBUFFER;
+
+                        IDirectSoundBuffer* primaryBuffer;
+                        if(SUCCEEDED(object->CreateSoundBuffer(&bufferDescription, &primaryBuffer, 0))) {
+                            Print("DirectSound: Primary buffer created successfully.\n");
+                            HRESULT ret = primaryBuffer->SetFormat((const WAVEFORMATEX*) &waveFormat);
+                            if(SUCCEEDED(ret)) {
+                                Print("DirectSound: Primary buffer format was set.\n");
+                            }
+                            else {
+                                Print("DirectSound: Primary buffer formatting failed.\n");
+                            }
+                        }
+                        else {
+                            Print("DirectSound: Primary buffer creation failed.\n");
+                        } // create primary sound buffer
+                    }
+                    else {
+                        Print("DirectSound: CooperationLevel change failed.\n");
+                    } // coop level
+
+                    DSBUFFERDESC bufferDescription = {};
+                    bufferDescription.dwSize = sizeof(bufferDescription);
+                    bufferDescription.dwFlags = 0;
+                    bufferDescription.dwBufferBytes = BufferSize;
+                    bufferDescription.lpwfxFormat = &waveFormat;
+                    HRESULT ret = object->CreateSoundBuffer(&bufferDescription, &globalSecondaryBuffer, 0);
+                    if(SUCCEEDED(ret)) {
+                        Print("DirectSound: Secondary buffer created successfully.\n");
+                    }
+                    else {
+                        Print("DirectSound: Secondary buffer creation failed.\n");
+                    }
+                }
+                else {
+                    Print("DirectSound: Interface creation failed.\n");
+                } // DirectSoundCreate
+            }
+            else {
+                Print("DirectSound: Library DSound.dll not found.\n");
+            } // libary dsound.dll exists
+        }
+
+        void EasyInitialization(HWND windowHandle) {
+            int samplesPerSecond = 48000;
+            // int16 == signed short
+            int bytesPerSample = sizeof(signed short) * 2;
+            int bufferSize = bytesPerSample * samplesPerSecond;
+            Initialize(windowHandle, samplesPerSecond, bufferSize);
+        }
+    
+        void GetCursors(DWORD* playCursor, DWORD* writeCursor) {
+            // We have the position of the play cursor and the write cursor.
+            // https://docs.microsoft.com/en-us/previous-versions/windows/desktop/ee418062(v=vs.85)
+            // "The write cursor is the point in the buffer ahead of which it is safe to write data to the buffer.
+            // . Data should not be written to the part of the buffer after the play cursor and before the write cursor."
+            HRESULT result = globalSecondaryBuffer->GetCurrentPosition(playCursor, writeCursor);
+            if (result != DS_OK) {
+                switch (result) {
+                    case DSERR_INVALIDPARAM: {
+                        assert(false && "DirectSound Buffer GetCurrentPosition DSERR_INVALIDPARAM");
+                    } break;
+                    case DSERR_PRIOLEVELNEEDED: {
+                        assert(false && "DirectSound Buffer GetCurrentPosition DSERR_PRIOLEVELNEEDED");
+                    } break;
+                    default: {
+                        assert(false && "Unreachable error code (DSOUND Buffer GetCurrentPosition)");
+                    } break;
+                }
+            }
+        }
+
+        // Locks bytesToWrite bytes at offset in the buffer, which come back as one or two regions (see AudioDevice::Lock)
+        void LockBuffer(DWORD offset, DWORD bytesToWrite, void** bufferPointer1, unsigned long* bufferSize1, void** bufferPointer2, unsigned long* bufferSize2) {
+            // Play sounds!
+            // . https://hero.handmade.network/episode/code/day008/
+            // . * A square wave oscillates between "full-positive" to "full-negative" every half period
+            // . * A Stereo (2-channel) 16-bit PCM audio buffer is arranged as an array of signed int16 values in (left channel value, right channel value) pairs
+            // . * A "sample" sometimes refers to the values for all channels in a sampling period, and sometimes a value for a single channel. Be careful.
+            // . The procedure for writing sound data into a buffer is as follows:
+            // . 1. Figure out where in the buffer you want to start writing, and how much data you want to write
+            // .     Its useful to look at the play cursor - IDirectSoundBuffer8::GetCurrentPosition() (that's AudioThread's job)
+            // . 2. Acquire a lock on the buffer - IDirectSoundBuffer8::Lock()
+            // .     Because we are working with a circular buffer, this call will return 1 or 2 writable regions
+            // . 3. Write the samples to the buffer
+            // . 4. Unlock the regions - IDirectSoundBuffer8::Unlock()
+
+            // Lock the audio buffer
+            // We will receive up to 2 "buffers" to write, since it's a circular buffer, so we will have to check wether we got 1 or 2
+            *bufferPointer1 = NULL;
+            *bufferSize1 = 0;
+            *bufferPointer2 = NULL;
+            *bufferSize2 = 0;
+            DWORD lockFlags = 0;
+            // Possible flags:
+            // . DSBLOCK_FROMWRITECURSOR Start the lock at the write cursor. The dwOffset parameter is ignored.
+            // . DSBLOCK_ENTIREBUFFER Lock the entire buffer. The dwBytes parameter is ignored.
+            {
+                HRESULT result = globalSecondaryBuffer->Lock(
+                    offset, bytesToWrite, bufferPointer1, bufferSize1, bufferPointer2, bufferSize2, lockFlags
+                );
+                if (result != DS_OK) {
+                    switch (result) {
+                        case DSERR_BUFFERLOST: {
+                            assert(false && "DirectSound Buffer Lock DSERR_BUFFERLOST");
+                        } break;
+                        case DSERR_INVALIDCALL: {
+                            assert(false && "DirectSound Buffer Lock DSERR_INVALIDCALL");
+                        } break;
+                        case DSERR_INVALIDPARAM: {
+                            assert(false && "DirectSound Buffer Lock DSERR_INVALIDPARAM");
+                        } break;
+                        case DSERR_PRIOLEVELNEEDED: {
+                            assert(false && "DirectSound Buffer Lock DSERR_PRIOLEVELNEEDED");
+                        } break;
+                        default: {
+                            assert(false && "Unreachable error code (DSOUND Buffer Lock)");
+                        } break;
+                    }
+                }
+            }
+            assert(*bufferSize1 + *bufferSize2 == bytesToWrite);
+        }
+
+        void UnlockBuffer(void* bufferPointer1, unsigned long bytesWritten1, void* bufferPointer2, unsigned long bytesWritten2) {
+            // Unlock the buffers
+            {
+                HRESULT result = globalSecondaryBuffer->Unlock(bufferPointer1, bytesWritten1, bufferPointer2, bytesWritten2);
+                if (result != DS_OK) {
+                    switch (result) {
+                        case DSERR_INVALIDCALL: {
+                            assert(false && "DirectSound Buffer Unlock DSERR_INVALIDCALL");
+                        } break;
+                        case DSERR_INVALIDPARAM: {
+                            assert(false && "DirectSound Buffer Unlock DSERR_INVALIDPARAM");
+                        } break;
+                        case DSERR_PRIOLEVELNEEDED: {
+                            assert(false && "DirectSound Buffer Unlock DSERR_PRIOLEVELNEEDED");
+                        } break;
+                        default: {
+                            assert(false && "Unreachable error code (DSOUND Buffer Unlock)");
+                        } break;
+                    }
+                }
+            }
+        }
+
+        void PlayBuffer() {
+            // https://docs.microsoft.com/en-us/previous-versions/windows/desktop/mt708933(v=vs.85)
+            // First 2 parameters are reserved and should always be 0
+            // Only flag available is DSBPLAY_LOOPING
+            HRESULT result = globalSecondaryBuffer->Play(0, 0, DSBPLAY_LOOPING);
+            if (result != DS_OK) {
+                switch (result) {
+                    case DSERR_BUFFERLOST: {
+                        assert(false && "DirectSound Buffer Play DSERR_BUFFERLOST");
+                    } break;
+                    case DSERR_INVALIDCALL: {
+                        assert(false && "DirectSound Buffer Play DSERR_INVALIDCALL");
+                    } break;
+                    case DSERR_INVALIDPARAM: {
+                        assert(false && "DirectSound Buffer Play DSERR_INVALIDPARAM");
+                    } break;
+                    case DSERR_PRIOLEVELNEEDED: {
+                        assert(false && "DirectSound Buffer Play DSERR_PRIOLEVELNEEDED");
+                    } break;
+                    default: {
+                        assert(false && "Unreachable error code (DSOUND Buffer Play)");
+                    } break;
+                }
+            }
+        }
+
+    }
+
+    // Where the mixed sound goes, modelled on a DirectSound buffer: a ring of bufferSize bytes of interleaved int16 stereo with
+    // a play cursor going around it, written by locking a region ahead of the cursor (in two pieces when it wraps around) and
+    // unlocking it once filled. DirectSound is the real thing, Null throws away what's written and WavFile appends it to a file.
+    // Those two have no hardware behind them, so their play cursor follows either the clock (realtime) or everything written so
+    // far (as fast as it gets written), and they have no latency of their own. They need no sound hardware but they are still
+    // Win32 code: the ring comes from HeapAlloc, the clock is QueryPerformanceCounter and the wav goes through CreateFileA.
+    struct AudioDevice {
+        enum Type { DirectSound, Null, WavFile };
+        struct Region {
+            void* data;
+            unsigned long bytes;
+        };
+        Type type;
+        int samplesPerSecond;
+        int bytesPerSample;
+        int bufferSize;
+        bool realtime;
+        // The ring of Null and WavFile
+        signed short* ring;
+        unsigned long long startCounter;
+        unsigned long long frequency;
+        unsigned long long writtenBytes;
+        // FNV-1a of every sample written, to compare runs
+        unsigned int checksum;
+        // WavFile
+        HANDLE file;
+        unsigned long long fileBytes;
+
+        // RIFF header of 16 bit stereo pcm, dataBytes long
+        static void MakeWavHeader(unsigned char header[44], int samplesPerSecond, DWORD dataBytes) {
+            DWORD riffBytes = dataBytes + 36;
+            DWORD formatBytes = 16;
+            WORD format = WAVE_FORMAT_PCM;
+            WORD channels = 2;
+            DWORD rate = samplesPerSecond;
+            DWORD bytesPerSecond = samplesPerSecond * 4;
+            WORD blockAlign = 4;
+            WORD bitsPerSample = 16;
+            CopyMemory(header, "RIFF", 4);
+            CopyMemory(header + 4, &riffBytes, 4);
+            CopyMemory(header + 8, "WAVEfmt ", 8);
+            CopyMemory(header + 16, &formatBytes, 4);
+            CopyMemory(header + 20, &format, 2);
+            CopyMemory(header + 22, &channels, 2);
+            CopyMemory(header + 24, &rate, 4);
+            CopyMemory(header + 28, &bytesPerSecond, 4);
+            CopyMemory(header + 32, &blockAlign, 2);
+            CopyMemory(header + 34, &bitsPerSample, 2);
+            CopyMemory(header + 36, "data", 4);
+            CopyMemory(header + 40, &dataBytes, 4);
+        }
+
+        void OpenCommon(Type deviceType, int samplesPerSecondIn, int bufferSizeIn) {
+            type = deviceType;
+            samplesPerSecond = samplesPerSecondIn;
+            bytesPerSample = sizeof(signed short) * 2;
+            bufferSize = bufferSizeIn - bufferSizeIn % bytesPerSample;
+            ring = NULL;
+            file = INVALID_HANDLE_VALUE;
+            writtenBytes = 0;
+            checksum = 2166136261u;
+            fileBytes = 0;
+            realtime = true;
+            // Start restarts the clock, this is for anything asking for the cursors before that
+            GetCpuCounterAndFrequencySeconds(&startCounter, &frequency);
+        }
+
+        bool OpenDirectSound(HWND windowHandle, int samplesPerSecondIn, int bufferSizeIn) {
+            OpenCommon(DirectSound, samplesPerSecondIn, bufferSizeIn);
+            DSOUND::Initialize(windowHandle, samplesPerSecond, bufferSize);
+            return DSOUND::globalSecondaryBuffer != NULL;
+        }
+
+        bool OpenNull(int samplesPerSecondIn, int bufferSizeIn, bool realtimeIn) {
+            OpenCommon(Null, samplesPerSecondIn, bufferSizeIn);
+            realtime = realtimeIn;
+            ring = (signed short*) HeapAlloc(GetProcessHeap(), 0, bufferSize);
+            return ring != NULL;
+        }
+
+        bool OpenWavFile(const char* path, int samplesPerSecondIn, int bufferSizeIn, bool realtimeIn) {
+            OpenCommon(WavFile, samplesPerSecondIn, bufferSizeIn);
+            realtime = realtimeIn;
+            file = CreateFileA(path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+            if (file == INVALID_HANDLE_VALUE) {
+                return false;
+            }
+            // The sizes get patched in Close
+            unsigned char header[44];
+            MakeWavHeader(header, samplesPerSecond, 0);
+            DWORD written;
+            WriteFile(file, header, sizeof(header), &written, NULL);
+            ring = (signed short*) HeapAlloc(GetProcessHeap(), 0, bufferSize);
+            return ring != NULL;
+        }
+
+        void Close() {
+            if (type == WavFile && file != INVALID_HANDLE_VALUE) {
+                unsigned char header[44];
+                MakeWavHeader(header, samplesPerSecond, (DWORD) fileBytes);
+                DWORD written;
+                SetFilePointer(file, 0, NULL, FILE_BEGIN);
+                WriteFile(file, header, sizeof(header), &written, NULL);
+                CloseHandle(file);
+                file = INVALID_HANDLE_VALUE;
+            }
+            if (ring) {
+                HeapFree(GetProcessHeap(), 0, ring);
+                ring = NULL;
+            }
+        }
+
+        void Start() {
+            if (type == DirectSound) {
+                DSOUND::PlayBuffer();
+            }
+            GetCpuCounterAndFrequencySeconds(&startCounter, &frequency);
+        }
+
+        void Stop() {
+            if (type == DirectSound) {
+                DSOUND::globalSecondaryBuffer->Stop();
+            }
+        }
+
+        void GetCursors(DWORD* playCursor, DWORD* writeCursor) {
+            if (type == DirectSound) {
+                DSOUND::GetCursors(playCursor, writeCursor);
+                return;
+            }
+            unsigned long long playedBytes = writtenBytes;
+            if (realtime) {
+                double ms;
+                unsigned long long fps;
+                GetTimeDifferenceMsAndFPS(startCounter, frequency, &ms, &fps);
+                playedBytes = (unsigned long long) (ms * samplesPerSecond / 1000.0) * bytesPerSample;
+            }
+            *playCursor = *writeCursor = (DWORD) (playedBytes % bufferSize);
+        }
+
+        // Samples that are always queued, the distance between the play and write cursors
+        int LatencySamples() {
+            DWORD playCursor, writeCursor;
+            GetCursors(&playCursor, &writeCursor);
+            return (int) ((writeCursor + bufferSize - playCursor) % bufferSize) / bytesPerSample;
+        }
+
+        // Locks bytes (whole samples) starting at offset, and returns in how many of regions they ended up
+        int Lock(DWORD offset, int bytes, Region regions[2]) {
+            assert(bytes <= bufferSize && offset < (DWORD) bufferSize);
+            if (type == DirectSound) {
+                DSOUND::LockBuffer(offset, (DWORD) bytes, &regions[0].data, &regions[0].bytes, &regions[1].data, &regions[1].bytes);
+            }
+            else {
+                unsigned long first = bufferSize - offset < (DWORD) bytes ? bufferSize - offset : bytes;
+                regions[0].data = (char*) ring + offset;
+                regions[0].bytes = first;
+                regions[1].data = ring;
+                regions[1].bytes = bytes - first;
+            }
+            return regions[1].bytes ? 2 : 1;
+        }
+
+        void Unlock(Region regions[2]) {
+            if (type == DirectSound) {
+                DSOUND::UnlockBuffer(regions[0].data, regions[0].bytes, regions[1].data, regions[1].bytes);
+                return;
+            }
+            for (int i = 0; i < 2; i++) {
+                const unsigned short* samples = (const unsigned short*) regions[i].data;
+                for (unsigned long j = 0; j < regions[i].bytes / sizeof(signed short); j++) {
+                    checksum = (checksum ^ samples[j]) * 16777619u;
+                }
+            }
+            if (type == WavFile) {
+                DWORD written;
+                for (int i = 0; i < 2; i++) {
+                    if (regions[i].bytes && WriteFile(file, regions[i].data, regions[i].bytes, &written, NULL)) {
+                        fileBytes += written;
+                    }
+                }
+            }
+            writtenBytes += regions[0].bytes + regions[1].bytes;
+        }
+    };
+
+    // Something the game wants the audio thread to do to a voice
+    struct AudioCommand {
+        enum Type { Play, PlayStream, Stop, SetVolume, SetPan, SetPitch };
+        Type type;
+        // Given by AudioThread::Play so that the game can refer to the voice before the audio thread has started it
+        unsigned int id;
+        const Mixer::Sound* sound;
+        Mixer::Stream* stream;
+        float volume;
+        float pan;
+        float pitch;
+        bool loop;
+    };
+
+    // Ring of commands with a single producer (the game) and a single consumer (the audio thread), so no locks needed.
+    // Each side only writes its own index, and only after the command it covers has been written or read
+    struct AudioCommandQueue {
+        static constexpr unsigned long size = 256;
+        AudioCommand commands[size];
+        volatile unsigned long head;
+        volatile unsigned long tail;
+
+        bool Push(const AudioCommand& command) {
+            unsigned long index = tail;
+            if (index - head == size) {
+                return false;
+            }
+            commands[index & (size - 1)] = command;
+            _ReadWriteBarrier();
+            tail = index + 1;
+            return true;
+        }
+
+        bool Pop(AudioCommand* command) {
+            unsigned long index = head;
+            if (index == tail) {
+                return false;
+            }
+            _ReadWriteBarrier();
+            *command = commands[index & (size - 1)];
+            _ReadWriteBarrier();
+            head = index + 1;
+            return true;
+        }
+    };
+
+    // Owns a Mixer and an AudioDevice once started. Every periodMs it runs the commands the game pushed and tops up the device
+    // to latencySamples ahead of its play cursor, so how much gets written depends on how much was played and not on how long
+    // a frame took. If the play cursor overtakes what was written (the thread didn't get to run in time) it starts over from the
+    // write cursor and counts an underrun. Devices that aren't realtime are topped up again without sleeping.
+    struct AudioThread {
+        HANDLE thread;
+        volatile LONG quit;
+        AudioCommandQueue queue;
+        Mixer mixer;
+        AudioDevice* device;
+        unsigned int nextId;
+        int latencySamples;
+        int periodMs;
+        // Where the next write starts
+        DWORD writeOffset;
+        volatile LONG underruns;
+
+        // Fills the device and starts it. With startThread false Update has to be called by hand
+        bool Start(AudioDevice* deviceIn, int latencySamplesIn, int periodMsIn, bool startThread = true) {
+            device = deviceIn;
+            latencySamples = latencySamplesIn;
+            periodMs = periodMsIn;
+            quit = 0;
+            underruns = 0;
+            nextId = 1;
+            thread = NULL;
+            queue.head = queue.tail = 0;
+            mixer.Initialize(device->samplesPerSecond);
+            DWORD playCursor, writeCursor;
+            device->GetCursors(&playCursor, &writeCursor);
+            writeOffset = writeCursor;
+            Update();
+            device->Start();
+            if (!startThread) {
+                return true;
+            }
+            // Waking every few ms needs the finer scheduler granularity
+            timeBeginPeriod(1);
+            thread = CreateThread(NULL, 0, Main, this, 0, NULL);
+            assert(thread && "Couldn't create the audio thread");
+            SetThreadPriority(thread, THREAD_PRIORITY_HIGHEST);
+            return true;
+        }
+
+        void Stop() {
+            if (!device) return;
+            if (thread) {
+                InterlockedExchange(&quit, 1);
+                WaitForSingleObject(thread, INFINITE);
+                CloseHandle(thread);
+                thread = NULL;
+                timeEndPeriod(1);
+            }
+            device->Stop();
+            device = NULL;
+        }
 
-                        // As far as I know, the reason we have to create a main buffer (which we won't use) and then later on a "secondary buffer"
-                        // which we will actually work with is because nowadays windows (?) doesn't allow to write to the sound hardware directly (the main buffer)
-                        // and instead every application uses a secondary buffer, and later on windows mix every secondary buffer and does the necessary work with
-                        // that main buffer. Something like that...
-                        DSBUFFERDESC bufferDescription = {};
-                        bufferDescription.dwSize = sizeof(bufferDescription);
-                        bufferDescription.dwFlags = DSBCAPS_PRIMARYBUFFER;
+        // Game side. Returns the id of the voice, 0 if the queue is full
+        unsigned int Play(const Mixer::Sound* sound, float volume, float pan, float pitch, bool loop) {
+            AudioCommand command = {};
+            command.type = AudioCommand::Play;
+            command.id = nextId;
+            command.sound = sound;
+            command.volume = volume;
+            command.pan = pan;
+            command.pitch = pitch;
+            command.loop = loop;
+            if (!queue.Push(command)) {
+                return 0;
+            }
+            nextId = nextId == 0xFFFFFFFF ? 1 : nextId + 1;
+            return command.id;
+        }
 
-                        IDirectSoundBuffer* primaryBuffer;
-                        if(SUCCEEDED(object->CreateSoundBuffer(&bufferDescription, &primaryBuffer, 0))) {
-                            Print("DirectSound: Primary buffer created successfully.\n");
-                            HRESULT ret = primaryBuffer->SetFormat((const WAVEFORMATEX*) &waveFormat);
-                            if(SUCCEEDED(ret)) {
-                                Print("DirectSound: Primary buffer format was set.\n");
-                            }
-                            else {
-                                Print("DirectSound: Primary buffer formatting failed.\n");
-                            }
-                        }
-                        else {
-                            Print("DirectSound: Primary buffer creation failed.\n");
-                        } // create primary sound buffer
-                    }
-                    else {
-                        Print("DirectSound: CooperationLevel change failed.\n");
-                    } // coop level
+        // Game side. Like Play, for a stream out of SampleBank::OpenStream
+        unsigned int PlayStream(Mixer::Stream* stream, float volume, float pan, float pitch) {
+            AudioCommand command = {};
+            command.type = AudioCommand::PlayStream;
+            command.id = nextId;
+            command.stream = stream;
+            command.volume = volume;
+            command.pan = pan;
+            command.pitch = pitch;
+            if (!queue.Push(command)) {
+                return 0;
+            }
+            nextId = nextId == 0xFFFFFFFF ? 1 : nextId + 1;
+            return command.id;
+        }
 
-                    DSBUFFERDESC bufferDescription = {};
-                    bufferDescription.dwSize = sizeof(bufferDescription);
-                    bufferDescription.dwFlags = 0;
-                    bufferDescription.dwBufferBytes = BufferSize;
-                    bufferDescription.lpwfxFormat = &waveFormat;
-                    HRESULT ret = object->CreateSoundBuffer(&bufferDescription, &globalSecondaryBuffer, 0);
-                    if(SUCCEEDED(ret)) {
-                        Print("DirectSound: Secondary buffer created successfully.\n");
-                    }
-                    else {
-                        Print("DirectSound: Secondary buffer creation failed.\n");
+        bool Send(AudioCommand::Type type, unsigned int id, float value) {
+            AudioCommand command = {};
+            command.type = type;
+            command.id = id;
+            command.volume = command.pan = command.pitch = value;
+            return queue.Push(command);
+        }
+        bool StopVoice(unsigned int id) { return Send(AudioCommand::Stop, id, 0.0f); }
+        bool SetVolume(unsigned int id, float volume) { return Send(AudioCommand::SetVolume, id, volume); }
+        bool SetPan(unsigned int id, float pan) { return Send(AudioCommand::SetPan, id, pan); }
+        bool SetPitch(unsigned int id, float pitch) { return Send(AudioCommand::SetPitch, id, pitch); }
+
+        // Audio side
+        void RunCommands() {
+            AudioCommand command;
+            while (queue.Pop(&command)) {
+                switch (command.type) {
+                    case AudioCommand::Play: {
+                        mixer.Play(command.sound, command.volume, command.pan, command.pitch, command.loop, command.id);
+                    } break;
+                    case AudioCommand::PlayStream: {
+                        mixer.PlayStream(command.stream, command.volume, command.pan, command.pitch, command.id);
+                    } break;
+                    case AudioCommand::Stop: {
+                        mixer.Stop(mixer.FindVoice(command.id));
+                    } break;
+                    case AudioCommand::SetVolume: {
+                        mixer.SetVolume(mixer.FindVoice(command.id), command.volume);
+                    } break;
+                    case AudioCommand::SetPan: {
+                        mixer.SetPan(mixer.FindVoice(command.id), command.pan);
+                    } break;
+                    case AudioCommand::SetPitch: {
+                        mixer.SetPitch(mixer.FindVoice(command.id), command.pitch);
+                    } break;
+                }
+            }
+        }
+
+        void Update() {
+            PROFILE_ZONE("Audio update");
+            RunCommands();
+            DWORD playCursor, writeCursor;
+            device->GetCursors(&playCursor, &writeCursor);
+            int bufferSize = device->bufferSize;
+            int bytesPerSample = device->bytesPerSample;
+            // Bytes queued ahead of the play cursor, and the ones between it and the write cursor, which can't be touched
+            DWORD filled = (writeOffset + bufferSize - playCursor) % bufferSize;
+            DWORD unsafe = (writeCursor + bufferSize - playCursor) % bufferSize;
+            // Enough to last until the next wake, even if the latency asked for is lower than that
+            DWORD periodBytes = (DWORD) (device->samplesPerSecond * (periodMs + 1) / 1000) * bytesPerSample;
+            DWORD target = (DWORD) latencySamples * bytesPerSample;
+            if (target < unsafe + periodBytes) target = unsafe + periodBytes;
+            if (target > (DWORD) (bufferSize - bytesPerSample)) target = bufferSize - bytesPerSample;
+            // Never more than target gets queued, so more than that means the play cursor went past writeOffset
+            if (filled < unsafe || filled > target) {
+                InterlockedIncrement(&underruns);
+                writeOffset = writeCursor - writeCursor % bytesPerSample;
+                filled = (writeOffset + bufferSize - playCursor) % bufferSize;
+            }
+            if (filled < target) {
+                int bytes = (int) (target - filled) / bytesPerSample * bytesPerSample;
+                if (bytes > 0) {
+                    AudioDevice::Region regions[2];
+                    int regionCount = device->Lock(writeOffset, bytes, regions);
+                    for (int i = 0; i < regionCount; i++) {
+                        mixer.Mix((signed short*) regions[i].data, regions[i].bytes / bytesPerSample);
                     }
+                    device->Unlock(regions);
+                    writeOffset = (writeOffset + bytes) % bufferSize;
                 }
-                else {
-                    Print("DirectSound: Interface creation failed.\n");
-                } // DirectSoundCreate
             }
-            else {
-                Print("DirectSound: Library DSound.dll not found.\n");
-            } // libary dsound.dll exists
         }
 
-        void EasyInitialization(HWND windowHandle) {
-            int samplesPerSecond = 48000;
-            // int16 == signed short
-            int bytesPerSample = sizeof(signed short) * 2;
-            int bufferSize = bytesPerSample * samplesPerSecond;
-            Initialize(windowHandle, samplesPerSecond, bufferSize);
+        static DWORD WINAPI Main(LPVOID parameter) {
+            AudioThread* self = (AudioThread*) parameter;
+            while (!InterlockedCompareExchange(&self->quit, 0, 0)) {
+                self->Update();
+                if (self->device->realtime) {
+                    Sleep(self->periodMs);
+                }
+            }
+            return 0;
         }
-    
-        void ProcessFrameSound(int samplesPerSecond, int bytesPerSample) {
-            // Play sounds!
-            // . https://hero.handmade.network/episode/code/day008/
-            // . * A square wave oscillates between "full-positive" to "full-negative" every half period
-            // . * A Stereo (2-channel) 16-bit PCM audio buffer is arranged as an array of signed int16 values in (left channel value, right channel value) pairs
-            // . * A "sample" sometimes refers to the values for all channels in a sampling period, and sometimes a value for a single channel. Be careful.
-            // . The procedure for writing sound data into a buffer is as follows:
-            // . 1. Figure out where in the buffer you want to start writing, and how much data you want to write
-            // .     Its useful to look at the play cursor - IDirectSoundBuffer8::GetCurrentPosition()
-            // . 2. Acquire a lock on the buffer - IDirectSoundBuffer8::Lock()
-            // .     Because we are working with a circular buffer, this call will return 1 or 2 writable regions
-            // . 3. Write the samples to the buffer
-            // . 4. Unlock the regions - IDirectSoundBuffer8::Unlock()
-            {
-                // Get DSound buffer cursors
-                DWORD playCursor, writeCursor;
-                {
-                    // We have the position of the play cursor and the write cursor.
-                    // https://docs.microsoft.com/en-us/previous-versions/windows/desktop/ee418062(v=vs.85)
-                    // "The write cursor is the point in the buffer ahead of which it is safe to write data to the buffer.
-                    // . Data should not be written to the part of the buffer after the play cursor and before the write cursor."
-                    HRESULT result = globalSecondaryBuffer->GetCurrentPosition(&playCursor, &writeCursor);
-                    if (result != DS_OK) {
-                        switch (result) {
-                            case DSERR_INVALIDPARAM: {
-                                assert(false && "DirectSound Buffer GetCurrentPosition DSERR_INVALIDPARAM");
-                            } break;
-                            case DSERR_PRIOLEVELNEEDED: {
-                                assert(false && "DirectSound Buffer GetCurrentPosition DSERR_PRIOLEVELNEEDED");
-                            } break;
-                            default: {
-                                assert(false && "Unreachable error code (DSOUND Buffer GetCurrentPosition)");
-                            } break;
-                        }
+    };
+
+    // Sounds out of wav files that are mapped into memory rather than read. The headers are parsed in place and short 16 bit
+    // sounds are played straight from the mapping, so loading them copies nothing. Long ones (over streamSeconds) go through a
+    // Stream instead: a ring of about a second that Decode refills a chunk at a time ahead of the voice playing it, converting
+    // 8 bit, 24 bit and float pcm on the way, so all that's resident of a long track is the ring and what the system keeps of
+    // the mapping. Short sounds that aren't 16 bit get converted to the heap when loaded, which is the only copy made.
+    // Decode runs on its own thread (StartDecoder) or by hand, and a stream is meant for one voice (Mixer::PlayStream). Once the
+    // mixer says the stream ended, its owner closes it and the next Decode gives the slot back, so a ring is only ever freed or
+    // reused when neither the voice nor the decoder is using it.
+    struct SampleBank {
+        struct Entry {
+            HANDLE file;
+            HANDLE mapping;
+            const unsigned char* view;
+            // The data chunk, in the mapping
+            const unsigned char* data;
+            unsigned long frameCount;
+            int channels;
+            int samplesPerSecond;
+            // Of one channel, 1, 2, 3 or 4 (float)
+            int bytesPerSample;
+            bool isFloat;
+            bool streamed;
+            // What gets played if it isn't streamed
+            Mixer::Sound sound;
+            signed short* converted;
+        };
+        struct Stream {
+            const Entry* entry;
+            // What the voice plays (the ring) and how far it got, written by the mixer
+            Mixer::Stream mixed;
+            signed short* ring;
+            unsigned long ringFrames;
+            // Source frames in the ring so far, only Decode touches it
+            unsigned long long decodedFrames;
+            bool loop;
+            // Set by OpenStream and cleared by Decode after CloseStream, so the decoder is done with the slot when it's reused
+            volatile LONG active;
+            volatile LONG closing;
+            unsigned long underruns;
+        };
+        static constexpr int maxEntries = 64;
+        static constexpr int maxStreams = 8;
+        static constexpr unsigned long chunkFrames = 4096;
+        static constexpr int streamSeconds = 10;
+        Entry entries[maxEntries];
+        int entryCount;
+        Stream streams[maxStreams];
+        HANDLE thread;
+        volatile LONG quit;
+
+        // Finds the fmt and data chunks of a RIFF WAVE in memory. Only pcm (8, 16, 24 bit) and 32 bit float, mono or stereo
+        static bool ParseWav(const unsigned char* file, unsigned long long size, Entry* entry) {
+            if (size < 12 || CompareBytes(file, "RIFF", 4) || CompareBytes(file + 8, "WAVE", 4)) {
+                return false;
+            }
+            WORD format = 0, channels = 0, bitsPerSample = 0;
+            DWORD samplesPerSecond = 0;
+            const unsigned char* data = NULL;
+            DWORD dataBytes = 0;
+            unsigned long long offset = 12;
+            while (offset + 8 <= size) {
+                const unsigned char* chunk = file + offset;
+                DWORD chunkBytes;
+                CopyMemory(&chunkBytes, chunk + 4, 4);
+                if (chunkBytes > size - offset - 8) {
+                    // Truncated, take what's there
+                    chunkBytes = (DWORD) (size - offset - 8);
+                }
+                if (!CompareBytes(chunk, "fmt ", 4) && chunkBytes >= 16) {
+                    CopyMemory(&format, chunk + 8, 2);
+                    CopyMemory(&channels, chunk + 10, 2);
+                    CopyMemory(&samplesPerSecond, chunk + 12, 4);
+                    CopyMemory(&bitsPerSample, chunk + 22, 2);
+                    // WAVE_FORMAT_EXTENSIBLE keeps the actual format at the start of the sub format guid
+                    if (format == WAVE_FORMAT_EXTENSIBLE && chunkBytes >= 26) {
+                        CopyMemory(&format, chunk + 32, 2);
                     }
                 }
-                
+                else if (!CompareBytes(chunk, "data", 4)) {
+                    data = chunk + 8;
+                    dataBytes = chunkBytes;
+                }
+                // Chunks are word aligned
+                offset += 8 + chunkBytes + (chunkBytes & 1);
+            }
+            bool isPcm = format == WAVE_FORMAT_PCM && (bitsPerSample == 8 || bitsPerSample == 16 || bitsPerSample == 24);
+            bool isFloat = format == WAVE_FORMAT_IEEE_FLOAT && bitsPerSample == 32;
+            if (!data || !(isPcm || isFloat) || (channels != 1 && channels != 2) || samplesPerSecond == 0) {
+                return false;
+            }
+            entry->data = data;
+            entry->channels = channels;
+            entry->samplesPerSecond = samplesPerSecond;
+            entry->bytesPerSample = bitsPerSample / 8;
+            entry->isFloat = isFloat;
+            entry->frameCount = dataBytes / (entry->bytesPerSample * channels);
+            return entry->frameCount > 0;
+        }
 
-                // Figure out how many bytes to write in the buffer
-                int bytesToWrite;
-                // FIXME: Just for now
-                int framesPerSecond = 60;
-
-                int samplesPerFrame = (int)((float)samplesPerSecond/(float)framesPerSecond);
-                int bytesPerFrame = samplesPerFrame * bytesPerSample;
-
-                bytesToWrite = bytesPerFrame;
-
-                // Lock the audio buffer
-                // We will receive up to 2 "buffers" to write, since it's a circular buffer, so we will have to check wether we got 1 or 2
-                void* bufferPointer1 = NULL;
-                unsigned long bufferSize1 = 0;
-                void* bufferPointer2 = NULL;
-                unsigned long bufferSize2 = 0;
-                DWORD lockFlags = 0;
-                // Possible flags:
-                // . DSBLOCK_FROMWRITECURSOR Start the lock at the write cursor. The dwOffset parameter is ignored.
-                // . DSBLOCK_ENTIREBUFFER Lock the entire buffer. The dwBytes parameter is ignored.
-                bool usingTwoBuffers = false;
-                {
-                    HRESULT result = globalSecondaryBuffer->Lock(
-                        writeCursor, bytesToWrite, &bufferPointer1, &bufferSize1, &bufferPointer2, &bufferSize2, lockFlags
-                    );
-                    if (result != DS_OK) {
-                        switch (result) {
-                            case DSERR_BUFFERLOST: {
-                                assert(false && "DirectSound Buffer Lock DSERR_BUFFERLOST");
-                            } break;
-                            case DSERR_INVALIDCALL: {
-                                assert(false && "DirectSound Buffer Lock DSERR_INVALIDCALL");
-                            } break;
-                            case DSERR_INVALIDPARAM: {
-                                assert(false && "DirectSound Buffer Lock DSERR_INVALIDPARAM");
-                            } break;
-                            case DSERR_PRIOLEVELNEEDED: {
-                                assert(false && "DirectSound Buffer Lock DSERR_PRIOLEVELNEEDED");
-                            } break;
-                            default: {
-                                assert(false && "Unreachable error code (DSOUND Buffer Lock)");
-                            } break;
-                        }
-                    }
+        static int CompareBytes(const unsigned char* a, const char* b, int count) {
+            for (int i = 0; i < count; i++) {
+                if (a[i] != (unsigned char) b[i]) return 1;
+            }
+            return 0;
+        }
+
+        // Converts count frames from first on to int16, keeping the channels
+        static void ConvertFrames(const Entry& entry, unsigned long first, unsigned long count, signed short* out) {
+            unsigned long samples = count * entry.channels;
+            const unsigned char* in = entry.data + (unsigned long long) first * entry.channels * entry.bytesPerSample;
+            if (entry.isFloat) {
+                for (unsigned long i = 0; i < samples; i++) {
+                    float value;
+                    CopyMemory(&value, in + 4 * i, 4);
+                    value *= 32767.0f;
+                    out[i] = (signed short) (value > 32767.0f ? 32767.0f : (value < -32768.0f ? -32768.0f : value));
                 }
-                if (bufferSize1 < bytesToWrite) {
-                    usingTwoBuffers = true;
+                return;
+            }
+            switch (entry.bytesPerSample) {
+                case 1: {
+                    for (unsigned long i = 0; i < samples; i++) out[i] = (signed short) ((in[i] - 128) << 8);
+                } break;
+                case 2: {
+                    CopyMemory(out, in, samples * 2);
+                } break;
+                case 3: {
+                    // The top 16 bits of the little endian 24
+                    for (unsigned long i = 0; i < samples; i++) out[i] = (signed short) (in[3 * i + 1] | (in[3 * i + 2] << 8));
+                } break;
+            }
+        }
+
+        // Maps path and returns its index, or -1 if it can't be read or isn't a wav we can play
+        int Load(const char* path) {
+            if (entryCount == maxEntries) {
+                return -1;
+            }
+            Entry& entry = entries[entryCount];
+            ZeroMemory(&entry, sizeof(entry));
+            entry.file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+            if (entry.file == INVALID_HANDLE_VALUE) {
+                return -1;
+            }
+            LARGE_INTEGER size;
+            if (GetFileSizeEx(entry.file, &size) && size.QuadPart > 0) {
+                entry.mapping = CreateFileMappingA(entry.file, NULL, PAGE_READONLY, 0, 0, NULL);
+            }
+            if (entry.mapping) {
+                entry.view = (const unsigned char*) MapViewOfFile(entry.mapping, FILE_MAP_READ, 0, 0, 0);
+            }
+            if (!entry.view || !ParseWav(entry.view, size.QuadPart, &entry)) {
+                Unload(entry);
+                return -1;
+            }
+            entry.streamed = entry.frameCount > (unsigned long) entry.samplesPerSecond * streamSeconds;
+            if (!entry.streamed) {
+                entry.sound.channels = entry.channels;
+                entry.sound.samplesPerSecond = entry.samplesPerSecond;
+                entry.sound.frameCount = entry.frameCount;
+                if (entry.bytesPerSample == 2 && !entry.isFloat) {
+                    entry.sound.samples = (const signed short*) entry.data;
                 }
                 else {
-                    assert(bufferSize1 == bytesToWrite);
-                }
-
-                // TODO: Write the data to the buffer(s) and keep track of how much data was written in each buffer
-                // The buffers are arrays of signed int16
-                // int16 = signed short
-                signed short* buffer1 = (signed short*) bufferPointer1;
-                signed short* buffer2 = (signed short*) bufferPointer2;
-                int actualAmmountOfDataWrittenToBuffer1 = 0;
-                int actualAmmountOfDataWrittenToBuffer2 = 0;
-
-                // WARNING: I legit have no clue what I'm doing!!
-                // I'm trying to make a square sound wave of 60 hz
-                int hz = 60; // "oscillations"(no idea how to call this, gotta study sound basics lol) per second
-                int oscillationsPerFrame = (int)((float)hz / (float)framesPerSecond);
-                int volume = 16000;
-                int maxVol = volume;
-                int minVol = -volume;
-                
-                int ammountOfSamplesPerOscillation = (int)((float)samplesPerFrame / (float)oscillationsPerFrame);
-                int ammountOfSamplesPerHalfOscillation = ammountOfSamplesPerOscillation / 2;
-
-                int sampleCounter = 0;
-                if (usingTwoBuffers) {
-                    for(int i = 0; i < bufferSize1/sizeof(signed short); i++) {
-                        if (sampleCounter%ammountOfSamplesPerOscillation < ammountOfSamplesPerHalfOscillation) {
-                            buffer1[i] = (signed short)maxVol;
-                        }
-                        else {
-                            buffer1[i] = (signed short)minVol;
-                        }
-                        sampleCounter++;
-                    }
-                    for(int i = 0; i < bufferSize2/sizeof(signed short); i++) {
-                        if (sampleCounter%ammountOfSamplesPerOscillation < ammountOfSamplesPerHalfOscillation) {
-                            buffer2[i] = (signed short)maxVol;
-                        }
-                        else {
-                            buffer2[i] = (signed short)minVol;
-                        }
-                        sampleCounter++;
-                    }
-                    actualAmmountOfDataWrittenToBuffer1 = bufferSize1/sizeof(signed short) * sizeof(signed short);
-                    actualAmmountOfDataWrittenToBuffer2 = bufferSize2/sizeof(signed short) * sizeof(signed short);
+                    entry.converted = (signed short*) HeapAlloc(GetProcessHeap(), 0, sizeof(signed short) * entry.frameCount * entry.channels);
+                    ConvertFrames(entry, 0, entry.frameCount, entry.converted);
+                    entry.sound.samples = entry.converted;
                 }
-                else {
-                    for(int i = 0; i < bufferSize1/sizeof(signed short); i++) {
-                        if (sampleCounter%ammountOfSamplesPerOscillation < ammountOfSamplesPerHalfOscillation) {
-                            buffer1[i] = (signed short)maxVol;
-                        }
-                        else {
-                            buffer1[i] = (signed short)minVol;
-                        }
-                        sampleCounter++;
-                    }
-                    actualAmmountOfDataWrittenToBuffer1 = bufferSize1/sizeof(signed short) * sizeof(signed short);
+            }
+            return entryCount++;
+        }
+
+        static void Unload(Entry& entry) {
+            if (entry.converted) HeapFree(GetProcessHeap(), 0, entry.converted);
+            if (entry.view) UnmapViewOfFile(entry.view);
+            if (entry.mapping) CloseHandle(entry.mapping);
+            if (entry.file != INVALID_HANDLE_VALUE) CloseHandle(entry.file);
+            entry.converted = NULL;
+            entry.view = NULL;
+            entry.mapping = NULL;
+            entry.file = INVALID_HANDLE_VALUE;
+        }
+
+        // The sound to play for index, NULL if it has to be streamed (or isn't there)
+        const Mixer::Sound* Get(int index) {
+            if (index < 0 || index >= entryCount || entries[index].streamed) {
+                return NULL;
+            }
+            return &entries[index].sound;
+        }
+
+        bool IsStreamed(int index) {
+            return index >= 0 && index < entryCount && entries[index].streamed;
+        }
+
+        // Returns a new stream of index, already filled, for a voice to play. NULL if there are no free streams
+        Mixer::Stream* OpenStream(int index, bool loop) {
+            if (index < 0 || index >= entryCount) {
+                return NULL;
+            }
+            const Entry& entry = entries[index];
+            for (int i = 0; i < maxStreams; i++) {
+                Stream& stream = streams[i];
+                if (InterlockedCompareExchange(&stream.active, 0, 0)) continue;
+                // About a second, in whole chunks
+                unsigned long ringFrames = (entry.samplesPerSecond / chunkFrames + 1) * chunkFrames;
+                if (stream.ring && stream.ringFrames * stream.mixed.ring.channels < ringFrames * entry.channels) {
+                    HeapFree(GetProcessHeap(), 0, stream.ring);
+                    stream.ring = NULL;
                 }
-                assert(actualAmmountOfDataWrittenToBuffer1 + actualAmmountOfDataWrittenToBuffer2 == bytesToWrite);
+                if (!stream.ring) {
+                    stream.ring = (signed short*) HeapAlloc(GetProcessHeap(), 0, sizeof(signed short) * ringFrames * entry.channels);
+                    if (!stream.ring) return NULL;
+                }
+                stream.entry = &entry;
+                stream.ringFrames = ringFrames;
+                stream.decodedFrames = 0;
+                stream.loop = loop;
+                stream.closing = 0;
+                stream.underruns = 0;
+                stream.mixed.ring.samples = stream.ring;
+                stream.mixed.ring.frameCount = ringFrames;
+                stream.mixed.ring.channels = entry.channels;
+                stream.mixed.ring.samplesPerSecond = entry.samplesPerSecond;
+                stream.mixed.frames = loop ? 0 : entry.frameCount;
+                stream.mixed.played = 0;
+                stream.mixed.ended = 0;
+                DecodeStream(stream);
+                InterlockedExchange(&stream.active, 1);
+                return &stream.mixed;
+            }
+            return NULL;
+        }
 
-                // Unlock the buffers
-                {
-                    HRESULT result = globalSecondaryBuffer->Unlock(
-                        bufferPointer1, actualAmmountOfDataWrittenToBuffer1, bufferPointer2, actualAmmountOfDataWrittenToBuffer2
-                    );
-                    if (result != DS_OK) {
-                        switch (result) {
-                            case DSERR_INVALIDCALL: {
-                                assert(false && "DirectSound Buffer Unlock DSERR_INVALIDCALL");
-                            } break;
-                            case DSERR_INVALIDPARAM: {
-                                assert(false && "DirectSound Buffer Unlock DSERR_INVALIDPARAM");
-                            } break;
-                            case DSERR_PRIOLEVELNEEDED: {
-                                assert(false && "DirectSound Buffer Unlock DSERR_PRIOLEVELNEEDED");
-                            } break;
-                            default: {
-                                assert(false && "Unreachable error code (DSOUND Buffer Unlock)");
-                            } break;
-                        }
+        // Once the stream has ended (the mixer sets ended when the voice stops) or if it never got to a voice. The slot is free
+        // again after the next Decode
+        void CloseStream(Mixer::Stream* mixed) {
+            for (int i = 0; i < maxStreams; i++) {
+                if (&streams[i].mixed == mixed) InterlockedExchange(&streams[i].closing, 1);
+            }
+        }
+
+        // Fills the ring as far ahead of the voice as it can without touching what it may be reading
+        static void DecodeStream(Stream& stream) {
+            const Entry& entry = *stream.entry;
+            unsigned long long played = stream.mixed.played;
+            if (played > stream.decodedFrames) {
+                // The voice got past what was decoded, catch up with it
+                stream.underruns++;
+                stream.decodedFrames = played - played % chunkFrames;
+            }
+            while (stream.decodedFrames + chunkFrames <= played + stream.ringFrames) {
+                signed short* out = stream.ring + (stream.decodedFrames % stream.ringFrames) * entry.channels;
+                unsigned long done = 0;
+                while (done < chunkFrames) {
+                    unsigned long long source = stream.decodedFrames + done;
+                    if (!stream.loop && source >= entry.frameCount) {
+                        // Past the end, silence until the mixer stops the voice
+                        ZeroMemory(out + done * entry.channels, sizeof(signed short) * (chunkFrames - done) * entry.channels);
+                        break;
                     }
+                    unsigned long first = (unsigned long) (source % entry.frameCount);
+                    unsigned long count = entry.frameCount - first < chunkFrames - done ? entry.frameCount - first : chunkFrames - done;
+                    ConvertFrames(entry, first, count, out + done * entry.channels);
+                    done += count;
                 }
+                stream.decodedFrames += chunkFrames;
+            }
+        }
 
-                // Finally, play the buffer!
-                {
-                    // https://docs.microsoft.com/en-us/previous-versions/windows/desktop/mt708933(v=vs.85)
-                    // First 2 parameters are reserved and should always be 0
-                    // Only flag available is DSBPLAY_LOOPING
-                    HRESULT result = globalSecondaryBuffer->Play(0, 0, DSBPLAY_LOOPING);
-                    if (result != DS_OK) {
-                        switch (result) {
-                            case DSERR_BUFFERLOST: {
-                                assert(false && "DirectSound Buffer Play DSERR_BUFFERLOST");
-                            } break;
-                            case DSERR_INVALIDCALL: {
-                                assert(false && "DirectSound Buffer Play DSERR_INVALIDCALL");
-                            } break;
-                            case DSERR_INVALIDPARAM: {
-                                assert(false && "DirectSound Buffer Play DSERR_INVALIDPARAM");
-                            } break;
-                            case DSERR_PRIOLEVELNEEDED: {
-                                assert(false && "DirectSound Buffer Play DSERR_PRIOLEVELNEEDED");
-                            } break;
-                            default: {
-                                assert(false && "Unreachable error code (DSOUND Buffer Play)");
-                            } break;
-                        }
-                    }
+        // One pass over the active streams, giving back the ones that were closed
+        void Decode() {
+            PROFILE_ZONE("Decode streams");
+            for (int i = 0; i < maxStreams; i++) {
+                Stream& stream = streams[i];
+                if (!InterlockedCompareExchange(&stream.active, 0, 0)) continue;
+                if (InterlockedCompareExchange(&stream.closing, 0, 0)) {
+                    // Last time the slot is touched until OpenStream hands it out again
+                    InterlockedExchange(&stream.active, 0);
+                    continue;
                 }
+                DecodeStream(stream);
             }
         }
-    }
+
+        static DWORD WINAPI Main(LPVOID parameter) {
+            SampleBank* self = (SampleBank*) parameter;
+            while (!InterlockedCompareExchange(&self->quit, 0, 0)) {
+                self->Decode();
+                // The rings hold about a second, so this is plenty
+                Sleep(10);
+            }
+            return 0;
+        }
+
+        void StartDecoder() {
+            quit = 0;
+            thread = CreateThread(NULL, 0, Main, this, 0, NULL);
+            assert(thread && "Couldn't create the decode thread");
+        }
+
+        void StopDecoder() {
+            if (!thread) return;
+            InterlockedExchange(&quit, 1);
+            WaitForSingleObject(thread, INFINITE);
+            CloseHandle(thread);
+            thread = NULL;
+        }
+
+        // Nothing may be playing from the bank anymore
+        void Release() {
+            StopDecoder();
+            for (int i = 0; i < entryCount; i++) {
+                Unload(entries[i]);
+            }
+            entryCount = 0;
+            for (int i = 0; i < maxStreams; i++) {
+                if (streams[i].ring) HeapFree(GetProcessHeap(), 0, streams[i].ring);
+                streams[i].ring = NULL;
+                streams[i].active = 0;
+                streams[i].closing = 0;
+            }
+        }
+    };
 }
 
 #include "resources.h"
+
+// Writes an RGBA8 image (r in the lowest byte, rows top to bottom) as a 32 bit BMP
+bool WriteBitmap(const char* path, const unsigned int* pixels, int width, int height) {
+    HANDLE file = CreateFileA(path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    // BITMAPFILEHEADER is 14 bytes and packed, so it's written by hand
+    unsigned char header[14 + 40] = {};
+    DWORD imageSize = width * height * 4;
+    DWORD fileSize = sizeof(header) + imageSize;
+    DWORD offset = sizeof(header);
+    header[0] = 'B';
+    header[1] = 'M';
+    CopyMemory(header + 2, &fileSize, 4);
+    CopyMemory(header + 10, &offset, 4);
+    BITMAPINFOHEADER info = {};
+    info.biSize = sizeof(info);
+    info.biWidth = width;
+    info.biHeight = -height;
+    info.biPlanes = 1;
+    info.biBitCount = 32;
+    info.biCompression = BI_RGB;
+    info.biSizeImage = imageSize;
+    CopyMemory(header + 14, &info, 40);
+    DWORD written;
+    bool ok = WriteFile(file, header, sizeof(header), &written, NULL) != 0;
+    // BMP wants BGRA
+    unsigned int row[4096];
+    for (int y = 0; ok && y < height; y++) {
+        for (int x = 0; x < width; x += 4096) {
+            int count = width - x < 4096 ? width - x : 4096;
+            for (int i = 0; i < count; i++) {
+                unsigned int pixel = pixels[y * width + x + i];
+                row[i] = (pixel & 0xFF00FF00) | ((pixel & 0xFF) << 16) | ((pixel >> 16) & 0xFF);
+            }
+            ok = ok && WriteFile(file, row, count * 4, &written, NULL) != 0;
+        }
+    }
+    CloseHandle(file);
+    return ok;
+}
+
+// --headless [--frames N] [--size WxH] [--quads N] [--threads N] [--dump file.bmp]
+// Renders N frames (300) of a scene like the one in WinMain plus quads random sprites (10000) with the software renderer at a
+// fixed resolution (1280x720), without a window or a gl context. Prints the time and a checksum of every frame, a summary at
+// the end, and dumps the last frame to a BMP if asked to
+int RunHeadless(PSTR cmdline) {
+    using R = Win32::SOFTWARE::Renderer;
+    int frames = 300, width = 1280, height = 720, quadCount = 10000;
+    SYSTEM_INFO system;
+    GetSystemInfo(&system);
+    int threads = (int) system.dwNumberOfProcessors;
+    const char* argument;
+    if ((argument = Win32::FindArgument(cmdline, "--frames"))) frames = atoi(argument);
+    if ((argument = Win32::FindArgument(cmdline, "--quads"))) quadCount = atoi(argument);
+    if ((argument = Win32::FindArgument(cmdline, "--threads"))) threads = atoi(argument);
+    if ((argument = Win32::FindArgument(cmdline, "--size"))) {
+        width = atoi(argument);
+        while (*argument && *argument != 'x') argument++;
+        if (*argument) height = atoi(argument + 1);
+    }
+    char dumpPath[MAX_PATH] = {};
+    if ((argument = Win32::FindArgument(cmdline, "--dump"))) {
+        for (int i = 0; i < MAX_PATH - 1 && argument[i] && argument[i] != ' '; i++) {
+            dumpPath[i] = argument[i];
+        }
+    }
+    if (threads < 1) threads = 1;
+    if (threads > Win32::ThreadPool::maxThreads) threads = Win32::ThreadPool::maxThreads;
+
+    Win32::ThreadPool pool;
+    pool.Initialize(threads - 1);
+    R r;
+    r.pool = &pool;
+    r.textureArrayWidth = texture_width;
+    r.textureArrayHeight = texture_height;
+    r.Initialize();
+    R::Texture tileset = r.LoadTexture((void*)texture_data, texture_width, texture_height);
+
+    // Sprites are 16x16 tiles of the tileset bouncing around
+    struct Sprite { float x, y, dx, dy; R::Texture texture; };
+    Sprite* sprites = (Sprite*) HeapAlloc(GetProcessHeap(), 0, sizeof(Sprite) * (quadCount ? quadCount : 1));
+    unsigned int random = 12345;
+    for (int i = 0; i < quadCount; i++) {
+        random = random * 1664525 + 1013904223;
+        sprites[i].x = (float) ((random >> 8) % width);
+        sprites[i].y = (float) ((random >> 16) % height);
+        sprites[i].dx = (float) ((int) (random % 7) - 3);
+        sprites[i].dy = (float) ((int) ((random >> 4) % 7) - 3);
+        int tile = (random >> 24) % ((texture_width / 16) * (texture_height / 16));
+        R::Point2i topLeft(tileset.u1 + (tile % (texture_width / 16)) * 16, tileset.v1 + (tile / (texture_width / 16)) * 16);
+        sprites[i].texture = R::Texture(topLeft, R::Point2i(topLeft.x + 16, topLeft.y + 16), tileset.layer);
+    }
+
+    Win32::FormattedPrint("Headless: %d frames at %dx%d, %d quads, %d threads\n", frames, width, height, quadCount, threads);
+    unsigned long long frequency, start, counter;
+    Win32::GetCpuCounterAndFrequencySeconds(&start, &frequency);
+    double totalMs = 0.0, minMs = 1e30, maxMs = 0.0;
+    for (int frame = 0; frame < frames; frame++) {
+        Win32::GetCpuCounterAndFrequencySeconds(&counter, &frequency);
+        r.BeginFrame(width, height, R::Color().White());
+        int A = frame % texture_width;
+        int B = frame % texture_height;
+        R::Texture fullTexture(R::Point2i(A, B), R::Point2i(A + texture_width, B + texture_height), tileset.layer);
+        r.AddQuad(R::Quad(R::Point2f(10, 10), R::Point2i(texture_width * 3, texture_height * 3), fullTexture, R::Color().White()));
+        for (int i = 0; i < quadCount; i++) {
+            Sprite& sprite = sprites[i];
+            sprite.x += sprite.dx;
+            sprite.y += sprite.dy;
+            if (sprite.x < -16 || sprite.x > width) sprite.dx = -sprite.dx;
+            if (sprite.y < -16 || sprite.y > height) sprite.dy = -sprite.dy;
+            r.AddSprite(R::Point2f(sprite.x, sprite.y), R::Point2i(16, 16), sprite.texture, R::Color(1.0f, 1.0f, 1.0f, 0.75f));
+        }
+        r.Render(width, height, R::Color().White(), NULL);
+        double ms;
+        unsigned long long fps;
+        Win32::GetTimeDifferenceMsAndFPS(counter, frequency, &ms, &fps);
+        // FNV-1a of the framebuffer, to compare runs and catch changes in the output
+        unsigned int checksum = 2166136261u;
+        for (int i = 0; i < width * height; i++) {
+            checksum = (checksum ^ r.framebuffer[i]) * 16777619u;
+        }
+        Win32::FormattedPrint("frame %d: %d us, checksum %08x\n", frame, (int) (ms * 1000.0), checksum);
+        totalMs += ms;
+        if (ms < minMs) minMs = ms;
+        if (ms > maxMs) maxMs = ms;
+    }
+    if (frames > 0) {
+        Win32::FormattedPrint("Headless: average %d us, min %d us, max %d us\n",
+            (int) (totalMs * 1000.0 / frames), (int) (minMs * 1000.0), (int) (maxMs * 1000.0));
+    }
+    if (dumpPath[0]) {
+        if (WriteBitmap(dumpPath, r.framebuffer, r.width, r.height)) {
+            Win32::FormattedPrint("Last frame written to %s\n", dumpPath);
+        }
+        else {
+            Win32::FormattedPrint("Couldn't write %s\n", dumpPath);
+        }
+    }
+    HeapFree(GetProcessHeap(), 0, sprites);
+    r.Release();
+    pool.Release();
+    return 0;
+}
+
+// --audio-offline [--seconds N] [--voices N] [--wav file.wav] [--play sound.wav]
+// Mixes N seconds (10) of audio with a number of voices (64) looping sounds at different pitches and pans, through the same path
+// as the audio thread but with a null device that takes it as fast as it gets written (or a wav file one if asked to), so no
+// sound hardware or waiting involved. --play loops a wav on top, streamed if it's long. Prints how long it took, samples per
+// second and a checksum of the output
+int RunOfflineAudio(PSTR cmdline) {
+    int seconds = 10, voiceCount = 64;
+    const char* argument;
+    if ((argument = Win32::FindArgument(cmdline, "--seconds"))) seconds = atoi(argument);
+    if ((argument = Win32::FindArgument(cmdline, "--voices"))) voiceCount = atoi(argument);
+    char wavPath[MAX_PATH] = {};
+    if ((argument = Win32::FindArgument(cmdline, "--wav"))) {
+        for (int i = 0; i < MAX_PATH - 1 && argument[i] && argument[i] != ' '; i++) {
+            wavPath[i] = argument[i];
+        }
+    }
+    char playPath[MAX_PATH] = {};
+    if ((argument = Win32::FindArgument(cmdline, "--play"))) {
+        for (int i = 0; i < MAX_PATH - 1 && argument[i] && argument[i] != ' '; i++) {
+            playPath[i] = argument[i];
+        }
+    }
+    if (seconds < 1) seconds = 1;
+    if (voiceCount < 0) voiceCount = 0;
+    // One for --play
+    if (voiceCount > Win32::Mixer::maxVoices - 1) voiceCount = Win32::Mixer::maxVoices - 1;
+
+    int samplesPerSecond = 48000;
+    int bufferSize = samplesPerSecond * sizeof(signed short) * 2;
+    Win32::AudioDevice device = {};
+    bool opened = wavPath[0]
+        ? device.OpenWavFile(wavPath, samplesPerSecond, bufferSize, false)
+        : device.OpenNull(samplesPerSecond, bufferSize, false);
+    if (!opened) {
+        Win32::FormattedPrint("Couldn't open %s\n", wavPath[0] ? wavPath : "the null device");
+        return 1;
+    }
+
+    // The square wave and a second of noise, mono and stereo
+    Win32::Mixer::Sound sounds[3];
+    Win32::MakeSquareWave(&sounds[0], samplesPerSecond, 60, 16000);
+    unsigned int random = 12345;
+    for (int s = 1; s < 3; s++) {
+        sounds[s].channels = s;
+        sounds[s].samplesPerSecond = 44100;
+        sounds[s].frameCount = 44100;
+        signed short* samples = (signed short*) HeapAlloc(GetProcessHeap(), 0, sizeof(signed short) * sounds[s].frameCount * s);
+        for (unsigned long i = 0; i < sounds[s].frameCount * s; i++) {
+            random = random * 1664525 + 1013904223;
+            samples[i] = (signed short) (random >> 16);
+        }
+        sounds[s].samples = samples;
+    }
+
+    // Updated by hand, 1024 samples at a time
+    Win32::AudioThread* audio = (Win32::AudioThread*) HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(Win32::AudioThread));
+    audio->Start(&device, 1024, 0, false);
+    unsigned int ids[Win32::Mixer::maxVoices];
+    for (int i = 0; i < voiceCount; i++) {
+        float pan = (float) (i % 9 - 4) / 4.0f;
+        float pitch = 0.5f + (float) (i % 7) / 4.0f;
+        // The queue holds fewer commands than there can be voices
+        while (!(ids[i] = audio->Play(&sounds[i % 3], 2.0f / voiceCount, pan, pitch, true))) {
+            audio->RunCommands();
+        }
+    }
+    // Decoded by hand right before every update, so that streaming doesn't depend on timing
+    Win32::SampleBank* bank = (Win32::SampleBank*) HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(Win32::SampleBank));
+    Win32::Mixer::Stream* stream = NULL;
+    if (playPath[0]) {
+        int index = bank->Load(playPath);
+        const Win32::Mixer::Sound* sound = bank->Get(index);
+        if (bank->IsStreamed(index) && (stream = bank->OpenStream(index, true))) {
+            Win32::FormattedPrint("Playing %s, streamed\n", playPath);
+            while (!audio->PlayStream(stream, 0.5f, 0.0f, 1.0f)) {
+                audio->RunCommands();
+            }
+        }
+        else if (sound) {
+            Win32::FormattedPrint("Playing %s\n", playPath);
+            while (!audio->Play(sound, 0.5f, 0.0f, 1.0f, true)) {
+                audio->RunCommands();
+            }
+        }
+        else {
+            Win32::FormattedPrint("Couldn't play %s\n", playPath);
+        }
+    }
+
+    Win32::FormattedPrint("Offline audio: %d s of %d voices at %d Hz\n", seconds, voiceCount, samplesPerSecond);
+    unsigned long long totalBytes = (unsigned long long) seconds * samplesPerSecond * device.bytesPerSample;
+    unsigned long long nextChange = 0;
+    int change = 0;
+    unsigned long long counter, frequency;
+    Win32::GetCpuCounterAndFrequencySeconds(&counter, &frequency);
+    while (device.writtenBytes < totalBytes) {
+        // Every 100 ms of audio retune and move one of the voices, like a game would
+        if (voiceCount && device.writtenBytes >= nextChange) {
+            unsigned int id = ids[change % voiceCount];
+            audio->SetPitch(id, 0.5f + (float) (change % 11) / 8.0f);
+            audio->SetPan(id, (float) (change % 5 - 2) / 2.0f);
+            change++;
+            nextChange += samplesPerSecond / 10 * device.bytesPerSample;
+        }
+        if (stream && stream->ended) {
+            bank->CloseStream(stream);
+            stream = NULL;
+        }
+        bank->Decode();
+        audio->Update();
+    }
+    double ms;
+    unsigned long long fps;
+    Win32::GetTimeDifferenceMsAndFPS(counter, frequency, &ms, &fps);
+    // A short run can take less than the timer resolution
+    if (ms <= 0.0) ms = 0.001;
+    unsigned long long samples = device.writtenBytes / device.bytesPerSample;
+    Win32::FormattedPrint("Offline audio: %d samples in %d ms, %d samples/s (%dx realtime), checksum %08x\n",
+        (int) samples, (int) ms, (int) (samples * 1000.0 / ms), (int) (samples * 1000.0 / ms / samplesPerSecond), device.checksum);
+    audio->Stop();
+    device.Close();
+    if (wavPath[0]) {
+        Win32::FormattedPrint("Written to %s\n", wavPath);
+    }
+    bank->Release();
+    HeapFree(GetProcessHeap(), 0, bank);
+    HeapFree(GetProcessHeap(), 0, audio);
+    for (int s = 0; s < 3; s++) {
+        HeapFree(GetProcessHeap(), 0, (void*) sounds[s].samples);
+    }
+    return 0;
+}
+
+// --bench [atlas] [text] [quads] [recording] [profiler] [mixer]
+// Runs the cpu benchmarks named after it, or all of them if none is, and prints their results. None of them needs a window, a
+// gl context or sound hardware
+int RunBenchmarks(PSTR cmdline) {
+    const char* names = Win32::FindArgument(cmdline, "--bench");
+    bool all = *names == 0 || *names == '-';
+    if (all || Win32::FindArgument(names, "atlas")) Win32::GL::BenchmarkAtlasPacking(10000);
+    if (all || Win32::FindArgument(names, "text")) Win32::GL::BenchmarkText(100000);
+    if (all || Win32::FindArgument(names, "quads")) Win32::GL::BenchmarkAddQuads(1000000);
+    if (all || Win32::FindArgument(names, "recording")) {
+        SYSTEM_INFO system;
+        GetSystemInfo(&system);
+        Win32::GL::BenchmarkRecording(1000000, (int) system.dwNumberOfProcessors);
+    }
+    if (all || Win32::FindArgument(names, "profiler")) {
+        Win32::Profiler::Initialize();
+        Win32::Profiler::Benchmark(1000000);
+    }
+    if (all || Win32::FindArgument(names, "mixer")) {
+        Win32::BenchmarkMixer(64, 48000, 10);
+        Win32::BenchmarkMixer(256, 48000, 10);
+    }
+    return 0;
+}
+
 int WinMain(HINSTANCE hInst, HINSTANCE hInstPrev, PSTR cmdline, int cmdshow) {
+    if (Win32::FindArgument(cmdline, "--bench")) {
+        Win32::GetConsole();
+        return RunBenchmarks(cmdline);
+    }
+    if (Win32::FindArgument(cmdline, "--headless")) {
+        Win32::GetConsole();
+        return RunHeadless(cmdline);
+    }
+    if (Win32::FindArgument(cmdline, "--audio-offline")) {
+        Win32::GetConsole();
+        return RunOfflineAudio(cmdline);
+    }
     bool isExternalConsole = Win32::GetConsole();
     Win32::Print("\n\n");
     const char windowClassName[] = "windowClass";
@@ -1185,20 +5472,132 @@ int WinMain(HINSTANCE hInst, HINSTANCE hInstPrev, PSTR cmdline, int cmdshow) {
     
     Win32::GL::InitializeWGlContext(deviceContextHandle);
     Win32::GL::GetGLExtensions();
+
+    // --vsync (default), --fps N to cap at N frames per second or --uncapped
+    Win32::FramePacer pacer;
+    const char* fpsArgument = Win32::FindArgument(cmdline, "--fps");
+    if (fpsArgument && atoi(fpsArgument) > 0) {
+        pacer.Initialize(Win32::FramePacer::Capped, 1000.0 / atoi(fpsArgument));
+    }
+    else if (Win32::FindArgument(cmdline, "--uncapped")) {
+        pacer.Initialize(Win32::FramePacer::Uncapped, 0.0);
+    }
+    else {
+        int refreshRate = GetDeviceCaps(deviceContextHandle, VREFRESH);
+        pacer.Initialize(Win32::FramePacer::Vsync, 1000.0 / (refreshRate > 1 ? refreshRate : 60));
+    }
+    Win32::GL::wglSwapIntervalEXT(pacer.mode == Win32::FramePacer::Vsync ? 1 : 0);
+
+    // --trace file.json to write the first 100000 profiler zones as a Chrome trace when closing
+    Win32::Profiler::Initialize();
+    const char* traceArgument = Win32::FindArgument(cmdline, "--trace");
+    char tracePath[MAX_PATH] = {};
+    if (traceArgument) {
+        for (int i = 0; traceArgument[i] && traceArgument[i] != ' ' && i < MAX_PATH - 1; i++) tracePath[i] = traceArgument[i];
+        Win32::Profiler::BeginCapture(100000);
+    }
     Win32::GL::Renderer r;
     using namespace Win32::GL;
     using R = Renderer;
 
+    // Same size as the tileset so that the scrolling below wraps around it
+    r.textureArrayWidth = texture_width;
+    r.textureArrayHeight = texture_height;
     r.Initialize();
-    r.LoadTexture((void*)texture_data, texture_width, texture_height);
+    R::Texture tileset = r.LoadTexture((void*)texture_data, texture_width, texture_height);
+    R::Font font(r.LoadTexture((void*)texture_font_data, texture_font_width, texture_font_height), 8, 8);
     r.LoadShader(fshader, fshader_size, Win32::GL::Renderer::shaderType::FragmentShader);
     r.LoadShader(vshader, vshader_size, Win32::GL::Renderer::shaderType::VertexShader);
     r.GenerateShaderProgram();
+    r.LoadInstancedShaders(vshader_instanced, vshader_instanced_size, fshader, fshader_size);
+    r.LoadTilemapShaders(vshader_tilemap, vshader_tilemap_size, fshader_tilemap, fshader_tilemap_size);
     bool running = true;
-    
-    unsigned long long cpuFrequencySeconds;
-    unsigned long long cpuCounter;
-    Win32::GetCpuCounterAndFrequencySeconds(&cpuCounter, &cpuFrequencySeconds);
+
+    // --tickrate N simulation ticks per second (60)
+    Win32::FixedTimestep timestep;
+    const char* tickRateArgument = Win32::FindArgument(cmdline, "--tickrate");
+    timestep.Initialize(tickRateArgument && atoi(tickRateArgument) > 0 ? atoi(tickRateArgument) : 60, 5);
+    // The scroll of the tileset, in texels, as of the last tick and the one before (not wrapped, so that they can be interpolated)
+    double scroll = 0.0;
+    double previousScroll = 0.0;
+
+    // --sound [--latency ms] plays the square wave that used to be hardcoded through the audio thread, 40 ms ahead of the play
+    // cursor by default. --sound null or --sound file.wav sends it nowhere or to a wav file instead of DirectSound.
+    // --play sound.wav loops a wav along with it
+    Win32::AudioDevice audioDevice = {};
+    Win32::AudioThread audioThread = {};
+    Win32::Mixer::Sound squareWave = {};
+    Win32::SampleBank sampleBank = {};
+    // The stream --play is going through, if it's long enough to be streamed, until it ends
+    Win32::Mixer::Stream* playingStream = NULL;
+    const char* soundArgument = Win32::FindArgument(cmdline, "--sound");
+    if (soundArgument) {
+        const char* latencyArgument = Win32::FindArgument(cmdline, "--latency");
+        int latencyMs = latencyArgument && atoi(latencyArgument) > 0 ? atoi(latencyArgument) : 40;
+        char soundSink[MAX_PATH] = {};
+        for (int i = 0; soundArgument[0] != '-' && soundArgument[i] && soundArgument[i] != ' ' && i < MAX_PATH - 1; i++) soundSink[i] = soundArgument[i];
+        // 48 kHz stereo int16 in a buffer of a second
+        int samplesPerSecond = 48000;
+        int bufferSize = samplesPerSecond * sizeof(signed short) * 2;
+        bool opened;
+        if (!soundSink[0]) opened = audioDevice.OpenDirectSound(windowHandle, samplesPerSecond, bufferSize);
+        else if (lstrcmpA(soundSink, "null") == 0) opened = audioDevice.OpenNull(samplesPerSecond, bufferSize, true);
+        else opened = audioDevice.OpenWavFile(soundSink, samplesPerSecond, bufferSize, true);
+        if (opened && audioThread.Start(&audioDevice, samplesPerSecond * latencyMs / 1000, 5)) {
+            Win32::MakeSquareWave(&squareWave, samplesPerSecond, 60, 16000);
+            audioThread.Play(&squareWave, 0.5f, 0.0f, 1.0f, true);
+            const char* playArgument = Win32::FindArgument(cmdline, "--play");
+            if (playArgument) {
+                char playPath[MAX_PATH] = {};
+                for (int i = 0; playArgument[i] && playArgument[i] != ' ' && i < MAX_PATH - 1; i++) playPath[i] = playArgument[i];
+                int index = sampleBank.Load(playPath);
+                const Win32::Mixer::Sound* sound = sampleBank.Get(index);
+                if (sampleBank.IsStreamed(index) && (playingStream = sampleBank.OpenStream(index, true))) {
+                    sampleBank.StartDecoder();
+                    audioThread.PlayStream(playingStream, 0.5f, 0.0f, 1.0f);
+                }
+                else if (sound) {
+                    audioThread.Play(sound, 0.5f, 0.0f, 1.0f, true);
+                }
+                else {
+                    Win32::Print("Couldn't play the sound\n");
+                }
+            }
+        }
+        else {
+            Win32::Print("Couldn't open the sound device\n");
+        }
+    }
+
+    // The render thread records big packets and copies the recordings into the stream on this pool
+    SYSTEM_INFO system;
+    GetSystemInfo(&system);
+    int workers = (int) system.dwNumberOfProcessors - 1;
+    if (workers > Win32::ThreadPool::maxThreads) workers = Win32::ThreadPool::maxThreads;
+    Win32::ThreadPool pool;
+    pool.Initialize(workers > 0 ? workers : 0);
+    r.pool = &pool;
+
+    // --sprites N adds N 16x16 tiles of the tileset bouncing around, as in --headless
+    struct Sprite { float x, y, dx, dy; R::Texture texture; };
+    const char* spritesArgument = Win32::FindArgument(cmdline, "--sprites");
+    int spriteCount = spritesArgument && atoi(spritesArgument) > 0 ? atoi(spritesArgument) : 0;
+    Sprite* sprites = (Sprite*) HeapAlloc(GetProcessHeap(), 0, sizeof(Sprite) * (spriteCount ? spriteCount : 1));
+    unsigned int random = 12345;
+    for (int i = 0; i < spriteCount; i++) {
+        random = random * 1664525 + 1013904223;
+        sprites[i].x = (float) ((random >> 8) % (clientW > 0 ? clientW : 1));
+        sprites[i].y = (float) ((random >> 16) % (clientH > 0 ? clientH : 1));
+        sprites[i].dx = (float) ((int) (random % 7) - 3);
+        sprites[i].dy = (float) ((int) ((random >> 4) % 7) - 3);
+        int tile = (random >> 24) % ((texture_width / 16) * (texture_height / 16));
+        R::Point2i topLeft(tileset.u1 + (tile % (texture_width / 16)) * 16, tileset.v1 + (tile / (texture_width / 16)) * 16);
+        sprites[i].texture = R::Texture(topLeft, R::Point2i(topLeft.x + 16, topLeft.y + 16), tileset.layer);
+    }
+
+    // From here on gl belongs to the render thread, this one only records frame packets
+    RenderThread renderThread;
+    renderThread.Start(&r, deviceContextHandle, font);
     
     // Main loop
     while (running) {
@@ -1215,51 +5614,73 @@ int WinMain(HINSTANCE hInst, HINSTANCE hInstPrev, PSTR cmdline, int cmdshow) {
             }
         }
 
-        // Write ms and fps at the top of the console
-        static double ms;
-        static unsigned long long fps;
-        static short cursorX;
-        static short cursorY;
-        cpuCounter = Win32::GetTimeDifferenceMsAndFPS(cpuCounter, cpuFrequencySeconds, &ms, &fps);
-        if (!Win32::GetConsoleCursorPosition(&cursorX, &cursorY)) {
-            Win32::FormattedPrint("Error getting the console cursor position!");
-            running = false;
-        }
-        if (!Win32::SetConsoleCursorPosition(0, 0)) {
-            Win32::FormattedPrint("Error setting the console cursor position!");
-            running = false;
+        // Update, one texel per tick
+        int ticks = timestep.Advance(pacer.frameMs);
+        {
+            PROFILE_ZONE("Simulate");
+            for (int tick = 0; tick < ticks; tick++) {
+                previousScroll = scroll;
+                scroll += 1.0;
+            }
         }
-        Win32::FormattedPrint("ms:  %f         \nfps: %d         ", ms, fps);
-        if (!Win32::SetConsoleCursorPosition(cursorX, cursorY)) {
-            Win32::FormattedPrint("Error setting the console cursor position!");
-            running = false;
+        // The decoder gives the slot back once the voice is done with it
+        if (playingStream && playingStream->ended) {
+            sampleBank.CloseStream(playingStream);
+            playingStream = NULL;
         }
 
-        // Update
-        static int A = 0;
-        static int B = 0;
-        A++;
-        A = A%texture_width;
-        B++;
-        B = B%texture_height;
+        double drawnScroll = previousScroll + (scroll - previousScroll) * timestep.Alpha();
+        int wholeScroll = (int) drawnScroll;
+        int A = wholeScroll % texture_width;
+        int B = wholeScroll % texture_height;
         
         // TODO: make textures be a point + size not topleft bottomright
         Renderer::Texture fullTexture(
             Renderer::Point2i(A,B),
-            Renderer::Point2i(A+texture_width,B+texture_height)
+            Renderer::Point2i(A+texture_width,B+texture_height),
+            tileset.layer
         );
         
         // TODO: Make a Quad Constructor that changes color gradually using static variables (+ a displacement so that I can potentially have many quads at a different point of the color scale) passed as a parameter
         // R::Quad myQuad(R::Point2f(10, 10), R::Point2i(texture_width*3,texture_height*3), fullTexture, R::Color::Gradual, 1337);
+        FramePacket* packet = renderThread.BeginPacket(clientW, clientH, Win32::GL::Renderer::Color().White());
         R::Quad myQuad(R::Point2f(10, 10), R::Point2i(texture_width*3,texture_height*3), fullTexture, R::Color().White());
-        r.AddQuad(myQuad);
-        
-        // TODO: Add Text!
-        r.Render(clientW, clientH, Win32::GL::Renderer::Color().White(), deviceContextHandle);
+        // The part of a texel that the interpolation adds goes into the uvs, so it shows between ticks
+        float scrollFraction = (float) (drawnScroll - wholeScroll);
+        myQuad.MoveTexture(scrollFraction, scrollFraction);
+        packet->AddQuad(myQuad);
+        for (int i = 0; i < spriteCount; i++) {
+            Sprite& sprite = sprites[i];
+            sprite.x += sprite.dx;
+            sprite.y += sprite.dy;
+            if (sprite.x < -16 || sprite.x > clientW) sprite.dx = -sprite.dx;
+            if (sprite.y < -16 || sprite.y > clientH) sprite.dy = -sprite.dy;
+            packet->AddSprite(R::Point2f(sprite.x, sprite.y), R::Point2i(16, 16), sprite.texture, R::Color(1.0f, 1.0f, 1.0f, 0.75f));
+        }
         
-        if (false && Win32::GL::GetErrors("Main Loop")) {
-            Win32::Print("Exiting because there were gl errors!");
-            running = false;
+        // ms and fps at the top left corner, the labels don't change so they come from the text cache
+        char hudValues[128];
+        StringCbPrintfA(hudValues, sizeof(hudValues), "%f\n%d\n%d\n%d", pacer.frameMs, (int) pacer.fps, (int) renderThread.lastFrameStats.flushes, (int) pacer.missedDeadlines);
+        packet->AddText(R::Point2f(10, 10), "ms:\nfps:\nflushes:\nmissed:", 2, R::Color().Black());
+        packet->AddText(R::Point2f(10 + 9 * 16, 10), hudValues, 2, R::Color().Black());
+        renderThread.SubmitPacket();
+        {
+            PROFILE_ZONE("Pace");
+            pacer.EndFrame();
         }
+        Win32::Profiler::EndFrame();
+    }
+    renderThread.Stop();
+    r.Release();
+    pool.Release();
+    HeapFree(GetProcessHeap(), 0, sprites);
+    audioThread.Stop();
+    audioDevice.Close();
+    sampleBank.Release();
+    pacer.Release();
+    Win32::Profiler::EndFrame();
+    Win32::Profiler::PrintLastFrame();
+    if (tracePath[0] && !Win32::Profiler::WriteChromeTrace(tracePath)) {
+        Win32::Print("Couldn't write the trace\n");
     }
 }
\ No newline at end of file
@@ -0,0 +1,394 @@
+// Audio mixing with nothing platform specific in it, only the C runtime and SSE2/AVX2 intrinsics, so it builds and can be
+// tested anywhere. main.cpp feeds it to the sound devices as Win32::Mixer
+#pragma once
+#include <cassert>
+#include <emmintrin.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+namespace Audio {
+    // Mixes any number of voices (int16 sounds, mono or stereo, with volume, pan and pitch) into interleaved int16 stereo.
+    // Voices are accumulated into a float bus, linearly interpolating the source at the voice's pitch (AVX2 gathers 8 frames
+    // at a time, SSE2 does 4), and the bus is then saturated to int16. Not thread safe, the thread that mixes should be the one
+    // that plays and stops voices.
+    struct Mixer {
+        struct Sound {
+            // Interleaved if stereo
+            const signed short* samples;
+            unsigned long frameCount;
+            int channels;
+            int samplesPerSecond;
+        };
+        // A sound whose samples are a ring that someone else refills ahead of the voice (SampleBank). The voice goes around the
+        // ring, tells how many source frames it went through in played and stops after frames of them (0 for never). Once its
+        // voice stops, because of that or any other reason, ended is set and the mixer won't touch the stream again
+        struct Stream {
+            Sound ring;
+            unsigned long long frames;
+            volatile unsigned long long played;
+            volatile long ended;
+        };
+        struct Voice {
+            const Sound* sound;
+            // 32.32 fixed point frames into the sound and how much it advances per output frame
+            unsigned long long position;
+            unsigned long long step;
+            float volume;
+            // -1 left to 1 right
+            float pan;
+            float pitch;
+            float gainLeft;
+            float gainRight;
+            bool loop;
+            bool active;
+            // NULL unless it was started with PlayStream
+            Stream* stream;
+            // 32.32 fixed point frames since it started, for streams
+            unsigned long long elapsed;
+            // Whatever the caller wants to find the voice by later, 0 for nothing
+            unsigned int id;
+        };
+        static constexpr int maxVoices = 256;
+        // Pitches are clamped to these, 0 or less (or NaN) makes no step that fits in unsigned and too much would overflow it
+        static constexpr float minPitch = 1.0f / 256.0f;
+        static constexpr float maxPitch = 256.0f;
+        // Frames mixed per pass, the bus is two floats per frame
+        static constexpr unsigned long busFrames = 1024;
+        Voice voices[maxVoices];
+        int samplesPerSecond;
+        float bus[2 * busFrames];
+
+        void Initialize(int outputSamplesPerSecond) {
+            samplesPerSecond = outputSamplesPerSecond;
+            for (int i = 0; i < maxVoices; i++) {
+                voices[i].active = false;
+                voices[i].stream = NULL;
+            }
+        }
+
+        void UpdateVoice(Voice& voice) {
+            // Balance rather than constant power, which would need a sin and cos
+            voice.gainLeft = voice.volume * (voice.pan > 0.0f ? 1.0f - voice.pan : 1.0f);
+            voice.gainRight = voice.volume * (voice.pan < 0.0f ? 1.0f + voice.pan : 1.0f);
+            // Written so that NaN ends up at minPitch too
+            if (!(voice.pitch >= minPitch)) voice.pitch = minPitch;
+            if (voice.pitch > maxPitch) voice.pitch = maxPitch;
+            double step = (double) voice.pitch * voice.sound->samplesPerSecond / samplesPerSecond;
+            voice.step = (unsigned long long) (step * 4294967296.0);
+            if (voice.step == 0) voice.step = 1;
+        }
+
+        // Returns the voice playing sound, or -1 if all of them are busy
+        int Play(const Sound* sound, float volume, float pan, float pitch, bool loop, unsigned int id = 0) {
+            assert(sound->channels == 1 || sound->channels == 2);
+            if (sound->frameCount == 0) {
+                return -1;
+            }
+            for (int i = 0; i < maxVoices; i++) {
+                Voice& voice = voices[i];
+                if (voice.active) continue;
+                voice.sound = sound;
+                voice.stream = NULL;
+                voice.position = 0;
+                voice.elapsed = 0;
+                voice.volume = volume;
+                voice.pan = pan;
+                voice.pitch = pitch;
+                voice.loop = loop;
+                voice.active = true;
+                voice.id = id;
+                UpdateVoice(voice);
+                return i;
+            }
+            return -1;
+        }
+
+        // Returns the voice playing stream, or -1 if all of them are busy, in which case the stream is ended right away
+        int PlayStream(Stream* stream, float volume, float pan, float pitch, unsigned int id = 0) {
+            stream->played = 0;
+            stream->ended = 0;
+            // The ring loops, the stream ends when it says so
+            int voice = Play(&stream->ring, volume, pan, pitch, true, id);
+            if (voice < 0) {
+                stream->ended = 1;
+                return -1;
+            }
+            voices[voice].stream = stream;
+            return voice;
+        }
+
+        // Returns the active voice played with id, or -1
+        int FindVoice(unsigned int id) {
+            for (int i = 0; id && i < maxVoices; i++) {
+                if (voices[i].active && voices[i].id == id) return i;
+            }
+            return -1;
+        }
+
+        void Stop(int voice) {
+            if (voice >= 0 && voice < maxVoices && voices[voice].active) EndVoice(voices[voice]);
+        }
+
+        // After this the voice doesn't read its sound anymore, so a stream can be told it's free
+        static void EndVoice(Voice& voice) {
+            voice.active = false;
+            if (voice.stream) {
+                voice.stream->ended = 1;
+                voice.stream = NULL;
+            }
+        }
+
+        void SetVolume(int voice, float volume) {
+            if (voice < 0 || voice >= maxVoices || !voices[voice].active) return;
+            voices[voice].volume = volume;
+            UpdateVoice(voices[voice]);
+        }
+
+        void SetPan(int voice, float pan) {
+            if (voice < 0 || voice >= maxVoices || !voices[voice].active) return;
+            voices[voice].pan = pan;
+            UpdateVoice(voices[voice]);
+        }
+
+        void SetPitch(int voice, float pitch) {
+            if (voice < 0 || voice >= maxVoices || !voices[voice].active) return;
+            voices[voice].pitch = pitch;
+            UpdateVoice(voices[voice]);
+        }
+
+        // The fraction is kept to 24 bits so that the simd versions, which convert it as a signed int, give the same result
+        static float Fraction(unsigned long long position) {
+            return (float) (int) ((position & 0xffffffff) >> 8) * (1.0f / 16777216.0f);
+        }
+
+        // Mixes count frames of voice, interpolating frame i with i + 1, so it has to stop before the last frame of the sound
+        static void MixFramesScalar(Voice& voice, float* out, unsigned long count) {
+            const signed short* samples = voice.sound->samples;
+            for (unsigned long i = 0; i < count; i++) {
+                unsigned long frame = (unsigned long) (voice.position >> 32);
+                float fraction = Fraction(voice.position);
+                if (voice.sound->channels == 1) {
+                    float a = samples[frame];
+                    float b = samples[frame + 1];
+                    float value = a + (b - a) * fraction;
+                    out[2 * i] += value * voice.gainLeft;
+                    out[2 * i + 1] += value * voice.gainRight;
+                }
+                else {
+                    float leftA = samples[2 * frame];
+                    float leftB = samples[2 * frame + 2];
+                    float rightA = samples[2 * frame + 1];
+                    float rightB = samples[2 * frame + 3];
+                    out[2 * i] += (leftA + (leftB - leftA) * fraction) * voice.gainLeft;
+                    out[2 * i + 1] += (rightA + (rightB - rightA) * fraction) * voice.gainRight;
+                }
+                voice.position += voice.step;
+            }
+        }
+
+#if defined(__AVX2__)
+        static void MixFrames(Voice& voice, float* out, unsigned long count) {
+            const int* samples = (const int*) voice.sound->samples;
+            unsigned long long position = voice.position;
+            unsigned long long step = voice.step;
+            // Positions of frames 0 to 3 and 4 to 7, the indices are the high dwords and the fractions the low ones
+            __m256i positionsLow = _mm256_setr_epi64x(position, position + step, position + 2 * step, position + 3 * step);
+            __m256i positionsHigh = _mm256_add_epi64(positionsLow, _mm256_set1_epi64x(4 * step));
+            __m256i increment = _mm256_set1_epi64x(8 * step);
+            __m256i odd = _mm256_setr_epi32(1, 3, 5, 7, 0, 2, 4, 6);
+            __m256i even = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+            __m256 toFraction = _mm256_set1_ps(1.0f / 16777216.0f);
+            __m256 gainLeft = _mm256_set1_ps(voice.gainLeft);
+            __m256 gainRight = _mm256_set1_ps(voice.gainRight);
+            bool stereo = voice.sound->channels == 2;
+            unsigned long i = 0;
+            for (; i + 8 <= count; i += 8) {
+                __m256i frame = _mm256_permute2x128_si256(
+                    _mm256_permutevar8x32_epi32(positionsLow, odd), _mm256_permutevar8x32_epi32(positionsHigh, odd), 0x20
+                );
+                __m256i fractionBits = _mm256_permute2x128_si256(
+                    _mm256_permutevar8x32_epi32(positionsLow, even), _mm256_permutevar8x32_epi32(positionsHigh, even), 0x20
+                );
+                __m256 fraction = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_srli_epi32(fractionBits, 8)), toFraction);
+                __m256 left, right;
+                if (!stereo) {
+                    // A dword at sample i is sample i in the low half and sample i + 1 in the high half
+                    __m256i taps = _mm256_i32gather_epi32(samples, frame, 2);
+                    __m256 a = _mm256_cvtepi32_ps(_mm256_srai_epi32(_mm256_slli_epi32(taps, 16), 16));
+                    __m256 b = _mm256_cvtepi32_ps(_mm256_srai_epi32(taps, 16));
+                    __m256 value = _mm256_add_ps(a, _mm256_mul_ps(_mm256_sub_ps(b, a), fraction));
+                    left = _mm256_mul_ps(value, gainLeft);
+                    right = _mm256_mul_ps(value, gainRight);
+                }
+                else {
+                    // A dword at frame i is left in the low half and right in the high half
+                    __m256i tapsA = _mm256_i32gather_epi32(samples, frame, 4);
+                    __m256i tapsB = _mm256_i32gather_epi32(samples, _mm256_add_epi32(frame, _mm256_set1_epi32(1)), 4);
+                    __m256 leftA = _mm256_cvtepi32_ps(_mm256_srai_epi32(_mm256_slli_epi32(tapsA, 16), 16));
+                    __m256 leftB = _mm256_cvtepi32_ps(_mm256_srai_epi32(_mm256_slli_epi32(tapsB, 16), 16));
+                    __m256 rightA = _mm256_cvtepi32_ps(_mm256_srai_epi32(tapsA, 16));
+                    __m256 rightB = _mm256_cvtepi32_ps(_mm256_srai_epi32(tapsB, 16));
+                    left = _mm256_mul_ps(_mm256_add_ps(leftA, _mm256_mul_ps(_mm256_sub_ps(leftB, leftA), fraction)), gainLeft);
+                    right = _mm256_mul_ps(_mm256_add_ps(rightA, _mm256_mul_ps(_mm256_sub_ps(rightB, rightA), fraction)), gainRight);
+                }
+                // Interleave, unpack works within the 128 bit lanes so lanes need to be put back in order
+                __m256 low = _mm256_unpacklo_ps(left, right);
+                __m256 high = _mm256_unpackhi_ps(left, right);
+                float* bus = out + 2 * i;
+                _mm256_storeu_ps(bus, _mm256_add_ps(_mm256_loadu_ps(bus), _mm256_permute2f128_ps(low, high, 0x20)));
+                _mm256_storeu_ps(bus + 8, _mm256_add_ps(_mm256_loadu_ps(bus + 8), _mm256_permute2f128_ps(low, high, 0x31)));
+                positionsLow = _mm256_add_epi64(positionsLow, increment);
+                positionsHigh = _mm256_add_epi64(positionsHigh, increment);
+            }
+            voice.position = position + i * step;
+            MixFramesScalar(voice, out + 2 * i, count - i);
+        }
+#elif defined(_M_X64) || defined(__SSE2__)
+        static void MixFrames(Voice& voice, float* out, unsigned long count) {
+            const signed short* samples = voice.sound->samples;
+            unsigned long long position = voice.position;
+            unsigned long long step = voice.step;
+            __m128i positions01 = _mm_set_epi64x(position + step, position);
+            __m128i positions23 = _mm_set_epi64x(position + 3 * step, position + 2 * step);
+            __m128i increment = _mm_set1_epi64x(4 * step);
+            __m128 toFraction = _mm_set1_ps(1.0f / 16777216.0f);
+            __m128 gainLeft = _mm_set1_ps(voice.gainLeft);
+            __m128 gainRight = _mm_set1_ps(voice.gainRight);
+            bool stereo = voice.sound->channels == 2;
+            unsigned long i = 0;
+            for (; i + 4 <= count; i += 4) {
+                __m128i fractionBits = _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(positions01), _mm_castsi128_ps(positions23), _MM_SHUFFLE(2, 0, 2, 0)));
+                __m128 fraction = _mm_mul_ps(_mm_cvtepi32_ps(_mm_srli_epi32(fractionBits, 8)), toFraction);
+                unsigned long long p = position + i * step;
+                unsigned long f0 = (unsigned long) (p >> 32);
+                unsigned long f1 = (unsigned long) ((p + step) >> 32);
+                unsigned long f2 = (unsigned long) ((p + 2 * step) >> 32);
+                unsigned long f3 = (unsigned long) ((p + 3 * step) >> 32);
+                __m128 left, right;
+                if (!stereo) {
+                    // Sample i in the low half of each dword and sample i + 1 in the high half
+                    __m128i taps = _mm_setr_epi16(
+                        samples[f0], samples[f0 + 1], samples[f1], samples[f1 + 1], samples[f2], samples[f2 + 1], samples[f3], samples[f3 + 1]
+                    );
+                    __m128 a = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_slli_epi32(taps, 16), 16));
+                    __m128 b = _mm_cvtepi32_ps(_mm_srai_epi32(taps, 16));
+                    __m128 value = _mm_add_ps(a, _mm_mul_ps(_mm_sub_ps(b, a), fraction));
+                    left = _mm_mul_ps(value, gainLeft);
+                    right = _mm_mul_ps(value, gainRight);
+                }
+                else {
+                    __m128i tapsLeft = _mm_setr_epi16(
+                        samples[2 * f0], samples[2 * f0 + 2], samples[2 * f1], samples[2 * f1 + 2],
+                        samples[2 * f2], samples[2 * f2 + 2], samples[2 * f3], samples[2 * f3 + 2]
+                    );
+                    __m128i tapsRight = _mm_setr_epi16(
+                        samples[2 * f0 + 1], samples[2 * f0 + 3], samples[2 * f1 + 1], samples[2 * f1 + 3],
+                        samples[2 * f2 + 1], samples[2 * f2 + 3], samples[2 * f3 + 1], samples[2 * f3 + 3]
+                    );
+                    __m128 leftA = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_slli_epi32(tapsLeft, 16), 16));
+                    __m128 leftB = _mm_cvtepi32_ps(_mm_srai_epi32(tapsLeft, 16));
+                    __m128 rightA = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_slli_epi32(tapsRight, 16), 16));
+                    __m128 rightB = _mm_cvtepi32_ps(_mm_srai_epi32(tapsRight, 16));
+                    left = _mm_mul_ps(_mm_add_ps(leftA, _mm_mul_ps(_mm_sub_ps(leftB, leftA), fraction)), gainLeft);
+                    right = _mm_mul_ps(_mm_add_ps(rightA, _mm_mul_ps(_mm_sub_ps(rightB, rightA), fraction)), gainRight);
+                }
+                float* bus = out + 2 * i;
+                _mm_storeu_ps(bus, _mm_add_ps(_mm_loadu_ps(bus), _mm_unpacklo_ps(left, right)));
+                _mm_storeu_ps(bus + 4, _mm_add_ps(_mm_loadu_ps(bus + 4), _mm_unpackhi_ps(left, right)));
+                positions01 = _mm_add_epi64(positions01, increment);
+                positions23 = _mm_add_epi64(positions23, increment);
+            }
+            voice.position = position + i * step;
+            MixFramesScalar(voice, out + 2 * i, count - i);
+        }
+#else
+        static void MixFrames(Voice& voice, float* out, unsigned long count) {
+            MixFramesScalar(voice, out, count);
+        }
+#endif
+
+        // Mixes up to count frames of voice into out, stopping it when a sound that doesn't loop ends
+        static void MixVoice(Voice& voice, float* out, unsigned long count) {
+            const Sound& sound = *voice.sound;
+            unsigned long long last = (unsigned long long) (sound.frameCount - 1) << 32;
+            unsigned long long length = (unsigned long long) sound.frameCount << 32;
+            unsigned long done = 0;
+            while (done < count) {
+                if (voice.position < last) {
+                    // Every frame up to the last one has a next one to interpolate with
+                    unsigned long long frames = (last - voice.position + voice.step - 1) / voice.step;
+                    if (frames > count - done) frames = count - done;
+                    MixFrames(voice, out + 2 * done, (unsigned long) frames);
+                    done += (unsigned long) frames;
+                }
+                else if (voice.position < length) {
+                    // The last frame goes towards the first one when looping and towards silence otherwise
+                    unsigned long frame = sound.frameCount - 1;
+                    float fraction = Fraction(voice.position);
+                    for (int channel = 0; channel < 2; channel++) {
+                        int source = sound.channels == 2 ? channel : 0;
+                        float a = sound.samples[frame * sound.channels + source];
+                        float b = voice.loop ? sound.samples[source] : 0.0f;
+                        out[2 * done + channel] += (a + (b - a) * fraction) * (channel ? voice.gainRight : voice.gainLeft);
+                    }
+                    voice.position += voice.step;
+                    done++;
+                }
+                else if (voice.loop) {
+                    voice.position %= length;
+                }
+                else {
+                    voice.active = false;
+                    return;
+                }
+            }
+        }
+
+        // Saturates count floats of the bus to int16
+        static void ConvertToInt16(const float* in, signed short* out, unsigned long count) {
+            unsigned long i = 0;
+#if defined(_M_X64) || defined(__SSE2__)
+            // cvtps gives 0x80000000 for anything out of range, so clamp first and let packs do the rest
+            __m128 maximum = _mm_set1_ps(32767.0f);
+            __m128 minimum = _mm_set1_ps(-32768.0f);
+            for (; i + 8 <= count; i += 8) {
+                __m128i low = _mm_cvtps_epi32(_mm_max_ps(_mm_min_ps(_mm_loadu_ps(in + i), maximum), minimum));
+                __m128i high = _mm_cvtps_epi32(_mm_max_ps(_mm_min_ps(_mm_loadu_ps(in + i + 4), maximum), minimum));
+                _mm_storeu_si128((__m128i*) (out + i), _mm_packs_epi32(low, high));
+            }
+#endif
+            for (; i < count; i++) {
+                float value = in[i];
+                value = value > 32767.0f ? 32767.0f : (value < -32768.0f ? -32768.0f : value);
+                // Round to nearest like cvtps does (ties aside)
+                out[i] = (signed short) (value < 0.0f ? value - 0.5f : value + 0.5f);
+            }
+        }
+
+        // Writes frameCount frames of interleaved int16 stereo with every active voice mixed in
+        void Mix(signed short* out, unsigned long frameCount) {
+            while (frameCount) {
+                unsigned long frames = frameCount < busFrames ? frameCount : busFrames;
+                for (unsigned long i = 0; i < 2 * frames; i++) {
+                    bus[i] = 0.0f;
+                }
+                for (int v = 0; v < maxVoices; v++) {
+                    Voice& voice = voices[v];
+                    if (!voice.active) continue;
+                    MixVoice(voice, bus, frames);
+                    if (voice.stream) {
+                        voice.elapsed += voice.step * frames;
+                        voice.stream->played = voice.elapsed >> 32;
+                        if (voice.stream->frames && (voice.elapsed >> 32) >= voice.stream->frames) {
+                            EndVoice(voice);
+                        }
+                    }
+                }
+                ConvertToInt16(bus, out, 2 * frames);
+                out += 2 * frames;
+                frameCount -= frames;
+            }
+        }
+    };
+}
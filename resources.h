@@ -8,19 +8,61 @@ const char vshader[] =
 "layout (location = 0) in vec2 vertex_position;\n"
 "layout (location = 1) in vec2 vertex_uv;\n"
 "layout (location = 2) in vec4 vertex_color;\n"
+"layout (location = 3) in float vertex_layer;\n"
 "\n"
 "out vec2 texture_uv;\n"
 "out vec4 color;\n"
+"flat out float texture_layer;\n"
 "\n"
 "void main()\n"
 "{\n"
-"    texture_uv.x = vertex_uv.x / texture_dimensions.x;\n"
-"    texture_uv.y = vertex_uv.y / texture_dimensions.y;\n"
+"    vec2 uv = vertex_uv;\n"
+"    texture_layer = vertex_layer;\n"
+"    // A layer of -1 means it is packed in the 3 bits above the 13 bits of texel of u and v (CompactVertex)\n"
+"    if (vertex_layer < 0.0) {\n"
+"        vec2 high = floor(uv / 8192.0);\n"
+"        uv -= high * 8192.0;\n"
+"        texture_layer = high.x + high.y * 8.0;\n"
+"    }\n"
+"    texture_uv.x = uv.x / texture_dimensions.x;\n"
+"    texture_uv.y = uv.y / texture_dimensions.y;\n"
 "    color = vertex_color;\n"
 "    gl_Position = mvp * vec4(vertex_position, 0.0, 1.0);\n"
 "}";
 const int vshader_size = sizeof(vshader);
 
+// Same as vshader but for one instance per quad, drawn as a 4 vertex triangle strip
+const char vshader_instanced[] = 
+"#version 330 core\n"
+"\n"
+"uniform mat4 mvp;\n"
+"uniform vec2 texture_dimensions;\n"
+"\n"
+"layout (location = 0) in vec2 instance_position;\n"
+"layout (location = 1) in vec2 instance_size;\n"
+"layout (location = 2) in vec4 instance_uv;\n"
+"layout (location = 3) in vec4 instance_color;\n"
+"\n"
+"out vec2 texture_uv;\n"
+"out vec4 color;\n"
+"flat out float texture_layer;\n"
+"\n"
+"void main()\n"
+"{\n"
+"    // 0 top left, 1 bottom left, 2 top right, 3 bottom right\n"
+"    vec2 corner = vec2(gl_VertexID >> 1, gl_VertexID & 1);\n"
+"    // u1 and v1 carry the layer in the 3 bits above their 13 bits of texel, u2 and v2 the eighths of a texel the rect is moved by (Instance)\n"
+"    vec2 high = floor(instance_uv.xy / 8192.0);\n"
+"    vec2 subTexel = floor(instance_uv.zw / 8192.0);\n"
+"    vec2 uv = mix(instance_uv.xy - high * 8192.0, instance_uv.zw - subTexel * 8192.0, corner) + subTexel / 8.0;\n"
+"    texture_uv.x = uv.x / texture_dimensions.x;\n"
+"    texture_uv.y = uv.y / texture_dimensions.y;\n"
+"    texture_layer = high.x + high.y * 8.0;\n"
+"    color = instance_color;\n"
+"    gl_Position = mvp * vec4(instance_position + corner * instance_size, 0.0, 1.0);\n"
+"}";
+const int vshader_instanced_size = sizeof(vshader_instanced);
+
 const char fshader[] = 
 "#version 330 core\n"
 "\n"
@@ -28,15 +70,59 @@ const char fshader[] =
 "\n"
 "in vec2 texture_uv;\n"
 "in vec4 color;\n"
+"flat in float texture_layer;\n"
 "\n"
-"uniform sampler2D texture_sampler;\n"
+"uniform sampler2DArray texture_sampler;\n"
 "\n"
 "void main()\n"
 "{\n"
-"    FragColor = texture(texture_sampler, texture_uv) * color;\n"
+"    FragColor = texture(texture_sampler, vec3(texture_uv, texture_layer)) * color;\n"
 "}";
 const int fshader_size = sizeof(fshader);
 
+// A single triangle covering the whole screen, the tilemap is resolved per pixel in fshader_tilemap
+const char vshader_tilemap[] = 
+"#version 330 core\n"
+"\n"
+"void main()\n"
+"{\n"
+"    vec2 corner = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2);\n"
+"    gl_Position = vec4(corner * 2.0 - 1.0, 0.0, 1.0);\n"
+"}";
+const int vshader_tilemap_size = sizeof(vshader_tilemap);
+
+const char fshader_tilemap[] = 
+"#version 330 core\n"
+"\n"
+"out vec4 FragColor;\n"
+"\n"
+"uniform sampler2DArray texture_sampler;\n"
+"uniform usampler2D tile_indices;\n"
+"uniform vec2 viewport_size;\n"
+"uniform vec2 map_offset;\n"
+"uniform float map_scale;\n"
+"uniform vec2 map_size;\n"
+"uniform vec2 tile_size;\n"
+"uniform vec2 tileset_origin;\n"
+"uniform float tileset_columns;\n"
+"uniform float tileset_layer;\n"
+"\n"
+"void main()\n"
+"{\n"
+"    // Screen pixel with the origin at the top left, like everything else, then into map texels\n"
+"    vec2 pixel = vec2(gl_FragCoord.x, viewport_size.y - gl_FragCoord.y);\n"
+"    vec2 texel = (pixel - map_offset) / map_scale;\n"
+"    vec2 cell = floor(texel / tile_size);\n"
+"    if (any(lessThan(cell, vec2(0.0))) || any(greaterThanEqual(cell, map_size))) discard;\n"
+"    uint index = texelFetch(tile_indices, ivec2(cell), 0).r;\n"
+"    if (index == 0u) discard;\n"
+"    float tile = float(index - 1u);\n"
+"    vec2 tileOrigin = tileset_origin + vec2(mod(tile, tileset_columns), floor(tile / tileset_columns)) * tile_size;\n"
+"    vec2 inTile = texel - cell * tile_size;\n"
+"    FragColor = texelFetch(texture_sampler, ivec3(tileOrigin + inTile, tileset_layer), 0);\n"
+"}";
+const int fshader_tilemap_size = sizeof(fshader_tilemap);
+
 const char texture_name[15] = "my_tileset.png";
 const int texture_name_size = 15;
 #define constexpr_texture_width 128